@@ -0,0 +1,360 @@
+/*
+MIT License
+
+Copyright (c) 2025 Alex Ydens
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+Drives a running window manager from an ordinary X client and reports
+how long it takes to react. Meant to be run against Xvfb by `make bench`.
+Requests per operation are counted from the StructureNotify events our
+own windows receive, so each ConfigureNotify, MapNotify or UnmapNotify
+is one request the window manager sent.
+*/
+
+/* Feature test macros */
+#define _GNU_SOURCE               /* For clock_gettime() */
+
+/* Includes */
+#include <stdbool.h>              /* For booleans */
+#include <stdint.h>               /* For fixed-size integers */
+#include <stdlib.h>               /* For free(), qsort() and atoi() */
+#include <string.h>               /* For strcmp() */
+#include <stdio.h>                /* For console output */
+#include <time.h>                 /* For clock_gettime() */
+#include <poll.h>                 /* For poll() */
+#include <xcb/xcb.h>              /* X (windowing system) C Bindings */
+#include <xcb/xtest.h>            /* For xcb_test_fake_input() */
+
+/* Window we created */
+typedef struct {
+  xcb_window_t handle;
+  int16_t x, y;
+  uint16_t width, height;
+  bool mapped;
+  int configures; /* ConfigureNotify events so far */
+} bench_window_t;
+/* Timings for one kind of operation */
+typedef struct {
+  const char *name;
+  uint64_t samples[1024]; /* ns */
+  int num_samples;
+  int requests; /* Seen over all samples */
+} bench_result_t;
+
+/* Settings */
+#define MAX_WINDOWS 1024
+#define TIMEOUT 2000 /* ms */
+#define SETTLE_TIME 50 /* ms */
+#define KEY_SUPER 0xffeb
+#define KEY_ALT 0xffe9
+#define KEY_1 0x31
+#define KEY_2 0x32
+#define KEY_L 0x6c
+#define KEY_H 0x68
+
+/* Global state */
+static xcb_connection_t *connection = NULL;
+static xcb_screen_t *screen = NULL;
+static bench_window_t windows[MAX_WINDOWS];
+static int num_windows = 0;
+static int requests_seen = 0;
+static bench_result_t results[] = {
+  { .name = "map -> configured" },
+  { .name = "destroy -> relayout" },
+  { .name = "switch workspace away" },
+  { .name = "switch workspace back" },
+  { .name = "resize split" }
+};
+enum { MAP, DESTROY, SWITCH_AWAY, SWITCH_BACK, RESIZE };
+
+/* Helper function declaractions */
+static uint64_t get_time_ns(void);
+static void fail(const char *message);
+static bench_window_t *find_window(xcb_window_t handle);
+static void handle_event(xcb_generic_event_t *event);
+static bool process_events(int timeout);
+static void settle(void);
+static xcb_keycode_t find_keycode(xcb_keysym_t keysym);
+static void press_keys(xcb_keycode_t modifier, xcb_keycode_t key);
+static int count_mapped(void);
+static void record(int result, uint64_t start_time, int start_requests);
+static int compare_samples(const void *a, const void *b);
+static void report(bench_result_t *result);
+
+/* Entry point */
+int main(int argc, char *argv[]) {
+  int num = 20, repeats = 10;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "-n")) num = atoi(argv[i+1]);
+    else if (!strcmp(argv[i], "-r")) repeats = atoi(argv[i+1]);
+  }
+  if (num < 2 || num > MAX_WINDOWS) fail("-n must be between 2 and 1024");
+  if (repeats < 1 || repeats > 1024) fail("-r must be between 1 and 1024");
+
+  connection = xcb_connect(NULL, NULL);
+  if (xcb_connection_has_error(connection)) fail("Can't connect to X server");
+  screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+  const xcb_query_extension_reply_t *xtest =
+    xcb_get_extension_data(connection, &xcb_test_id);
+  if (!xtest || !xtest->present) fail("XTEST isn't available");
+  xcb_keycode_t super = find_keycode(KEY_SUPER);
+  xcb_keycode_t alt = find_keycode(KEY_ALT);
+  xcb_keycode_t one = find_keycode(KEY_1);
+  xcb_keycode_t two = find_keycode(KEY_2);
+  xcb_keycode_t l = find_keycode(KEY_L);
+  xcb_keycode_t h = find_keycode(KEY_H);
+
+  /* Map windows one at a time, each one splits the layout again */
+  for (int i = 0; i < num; i++) {
+    bench_window_t *window = &windows[num_windows++];
+    window->handle = xcb_generate_id(connection);
+    uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    xcb_create_window(
+        connection, XCB_COPY_FROM_PARENT, window->handle, screen->root,
+        0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+        screen->root_visual, XCB_CW_EVENT_MASK, &event_mask
+    );
+    settle();
+    uint64_t start_time = get_time_ns();
+    int start_requests = requests_seen;
+    xcb_map_window(connection, window->handle);
+    xcb_flush(connection);
+    while (!window->configures)
+      if (!process_events(TIMEOUT)) fail("Window was never configured");
+    record(MAP, start_time, start_requests);
+  }
+
+  /* Switch away from the workspace and back again */
+  for (int i = 0; i < repeats; i++) {
+    settle();
+    uint64_t start_time = get_time_ns();
+    int start_requests = requests_seen;
+    press_keys(super, two);
+    while (count_mapped())
+      if (!process_events(TIMEOUT)) fail("Workspace was never switched away");
+    record(SWITCH_AWAY, start_time, start_requests);
+
+    settle();
+    start_time = get_time_ns();
+    start_requests = requests_seen;
+    press_keys(super, one);
+    while (count_mapped() < num_windows)
+      if (!process_events(TIMEOUT)) fail("Workspace was never switched back");
+    record(SWITCH_BACK, start_time, start_requests);
+  }
+
+  /* Grow and shrink the split of the first window, under the pointer */
+  for (int i = 0; i < repeats; i++) {
+    settle();
+    bench_window_t *window = &windows[0];
+    xcb_warp_pointer(
+        connection, XCB_NONE, screen->root, 0, 0, 0, 0,
+        window->x + window->width / 2, window->y + window->height / 2
+    );
+    settle();
+    int configures = window->configures;
+    uint64_t start_time = get_time_ns();
+    int start_requests = requests_seen;
+    press_keys(alt, i % 2 ? h : l);
+    while (window->configures == configures)
+      if (!process_events(TIMEOUT)) fail("Split was never resized");
+    record(RESIZE, start_time, start_requests);
+  }
+
+  /* Destroy them again, every one but the last makes a sibling grow */
+  while (num_windows > 1) {
+    settle();
+    bench_window_t *window = &windows[num_windows - 1];
+    int configures = 0;
+    for (int i = 0; i < num_windows - 1; i++)
+      configures += windows[i].configures;
+    uint64_t start_time = get_time_ns();
+    int start_requests = requests_seen;
+    xcb_destroy_window(connection, window->handle);
+    xcb_flush(connection);
+    num_windows--;
+    for (;;) {
+      int now = 0;
+      for (int i = 0; i < num_windows; i++)
+        now += windows[i].configures;
+      if (now != configures) break;
+      if (!process_events(TIMEOUT)) fail("Nothing was laid out again");
+    }
+    record(DESTROY, start_time, start_requests);
+  }
+  xcb_destroy_window(connection, windows[0].handle);
+  xcb_flush(connection);
+
+  printf(
+      "%d windows, %d repeats\n%-24s %8s %8s %8s %8s %10s\n",
+      num, repeats, "operation", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)",
+      "requests"
+  );
+  for (int i = 0; i < (int)(sizeof(results)/sizeof(results[0])); i++)
+    report(&results[i]);
+  xcb_disconnect(connection);
+  return 0;
+}
+
+/* Helper function definitions */
+static uint64_t get_time_ns(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+static void fail(const char *message) {
+  fprintf(stderr, "bench: %s\n", message);
+  exit(1);
+}
+static bench_window_t *find_window(xcb_window_t handle) {
+  for (int i = 0; i < num_windows; i++)
+    if (windows[i].handle == handle)
+      return &windows[i];
+  return NULL;
+}
+static void handle_event(xcb_generic_event_t *event) {
+  bench_window_t *window = NULL;
+  switch (event->response_type & ~0x80) {
+    case XCB_CONFIGURE_NOTIFY: {
+      xcb_configure_notify_event_t *configure =
+        (xcb_configure_notify_event_t *)event;
+      if (!(window = find_window(configure->window))) break;
+      window->x = configure->x;
+      window->y = configure->y;
+      window->width = configure->width;
+      window->height = configure->height;
+      window->configures++;
+      requests_seen++;
+      break;
+    }
+    case XCB_MAP_NOTIFY:
+      window = find_window(((xcb_map_notify_event_t *)event)->window);
+      if (!window) break;
+      window->mapped = true;
+      requests_seen++;
+      break;
+    case XCB_UNMAP_NOTIFY:
+      window = find_window(((xcb_unmap_notify_event_t *)event)->window);
+      if (!window) break;
+      window->mapped = false;
+      requests_seen++;
+      break;
+  }
+}
+static bool process_events(int timeout) {
+  /* Handles whatever arrives within timeout, false if nothing did */
+  xcb_generic_event_t *event = xcb_poll_for_event(connection);
+  if (!event) {
+    struct pollfd pollfd = {
+      .fd = xcb_get_file_descriptor(connection),
+      .events = POLLIN
+    };
+    if (poll(&pollfd, 1, timeout) <= 0) return false;
+    event = xcb_poll_for_event(connection);
+  }
+  if (xcb_connection_has_error(connection)) fail("Lost connection");
+  while (event) {
+    handle_event(event);
+    free(event);
+    event = xcb_poll_for_queued_event(connection);
+  }
+  return true;
+}
+static void settle(void) {
+  /* Wait for the window manager to go quiet, so operations don't overlap */
+  xcb_flush(connection);
+  while (process_events(SETTLE_TIME));
+}
+static xcb_keycode_t find_keycode(xcb_keysym_t keysym) {
+  const xcb_setup_t *setup = xcb_get_setup(connection);
+  xcb_get_keyboard_mapping_reply_t *mapping = xcb_get_keyboard_mapping_reply(
+      connection,
+      xcb_get_keyboard_mapping(
+          connection, setup->min_keycode,
+          setup->max_keycode - setup->min_keycode + 1
+      ),
+      NULL
+  );
+  if (!mapping) fail("Failed to get keyboard mapping");
+  xcb_keysym_t *keysyms = xcb_get_keyboard_mapping_keysyms(mapping);
+  int num_keysyms = xcb_get_keyboard_mapping_keysyms_length(mapping);
+  xcb_keycode_t keycode = 0;
+  for (int i = 0; i < num_keysyms; i += mapping->keysyms_per_keycode)
+    if (keysyms[i] == keysym) {
+      keycode = setup->min_keycode + i / mapping->keysyms_per_keycode;
+      break;
+    }
+  free(mapping);
+  if (!keycode) fail("Keysym isn't on the keyboard");
+  return keycode;
+}
+static void press_keys(xcb_keycode_t modifier, xcb_keycode_t key) {
+  xcb_test_fake_input(
+      connection, XCB_KEY_PRESS, modifier, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0
+  );
+  xcb_test_fake_input(
+      connection, XCB_KEY_PRESS, key, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0
+  );
+  xcb_test_fake_input(
+      connection, XCB_KEY_RELEASE, key, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0
+  );
+  xcb_test_fake_input(
+      connection, XCB_KEY_RELEASE, modifier, XCB_CURRENT_TIME, XCB_NONE,
+      0, 0, 0
+  );
+  xcb_flush(connection);
+}
+static int count_mapped(void) {
+  int mapped = 0;
+  for (int i = 0; i < num_windows; i++)
+    mapped += windows[i].mapped;
+  return mapped;
+}
+static void record(int result, uint64_t start_time, int start_requests) {
+  uint64_t sample = get_time_ns() - start_time;
+  /* Count everything the operation caused, not just what we waited for */
+  settle();
+  bench_result_t *bench_result = &results[result];
+  if (bench_result->num_samples < 1024)
+    bench_result->samples[bench_result->num_samples++] = sample;
+  bench_result->requests += requests_seen - start_requests;
+}
+static int compare_samples(const void *a, const void *b) {
+  uint64_t sample_a = *(const uint64_t *)a, sample_b = *(const uint64_t *)b;
+  return sample_a < sample_b ? -1 : sample_a > sample_b;
+}
+static void report(bench_result_t *result) {
+  if (!result->num_samples) return;
+  qsort(
+      result->samples, result->num_samples, sizeof(uint64_t), compare_samples
+  );
+  int n = result->num_samples;
+  printf(
+      "%-24s %8.3f %8.3f %8.3f %8.3f %10.1f\n",
+      result->name,
+      result->samples[n * 50 / 100] / 1e6,
+      result->samples[n * 90 / 100] / 1e6,
+      result->samples[n * 99 / 100] / 1e6,
+      result->samples[n - 1] / 1e6,
+      (double)result->requests / n
+  );
+}
@@ -22,9 +22,13 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+/* Feature test macros */
+#define _GNU_SOURCE               /* For clock_gettime() */
+
 /* Includes */
-#include <fcntl.h>                /* For open() */
-#include <unistd.h>               /* For execvp(), dup2(), close(), fork() */
+#include <fcntl.h>                /* For open() and fcntl() */
+#include <unistd.h>               /* For close() and environ */
+#include <spawn.h>                /* For posix_spawnp() */
 #include <stdbool.h>              /* For booleans */
 #include <stdint.h>               /* For fixed-size integers */
 #include <stdarg.h>               /* For variadic arguments */
@@ -32,7 +36,21 @@ SOFTWARE.
 #include <string.h>               /* For strlen() and strerror() */
 #include <stdio.h>                /* For console output */
 #include <errno.h>                /* For errno */
+#include <limits.h>               /* For PATH_MAX */
+#include <poll.h>                 /* For poll() */
+#include <time.h>                 /* For clock_gettime() */
+#include <signal.h>               /* For sigprocmask() and signal() */
+#include <sys/epoll.h>            /* For epoll_wait() */
+#include <sys/signalfd.h>         /* For signalfd() */
+#include <sys/timerfd.h>          /* For timerfd_create() */
+#include <sys/wait.h>             /* For waitpid() */
+#include <sys/socket.h>           /* For socketpair() */
+#include <sys/stat.h>             /* For fstat() */
+#include <sys/uio.h>              /* For writev() */
+#include <sys/un.h>               /* For sockaddr_un */
+#include <sys/mman.h>             /* For memfd_create() and mmap() */
 #include <xcb/xcb.h>              /* X (windowing system) C Bindings */
+#include <xcb/xcbext.h>           /* For xcb_poll_for_reply() */
 #include <xkbcommon/xkbcommon.h>  /* X KeyBoard helpers */
 
 /* Log levels */
@@ -42,16 +60,194 @@ typedef enum {
   LOG_LEVEL_ERROR
 } log_level_t;
 
+/* Atoms */
+typedef enum {
+  ATOM_WM_PROTOCOLS,
+  ATOM_WM_DELETE_WINDOW,
+  NUM_ATOMS
+} atom_t;
+
 /* Direction */
 typedef enum { DIR_HORIZONTAL, DIR_VERTICAL } direction_t;
-/* Region of space */
+/* Region of space, free ones are chained through parent */
 typedef struct {
   xcb_window_t handle;
   int parent, child0, child1;
   direction_t split;
   float factor;
   bool exists;
+  uint16_t x, y, width, height; /* As of the last layout */
+  bool dirty; /* Needs laying out again, so do all its ancestors */
 } region_t;
+/* Where a managed window lives in the region trees */
+typedef struct {
+  xcb_window_t window; /* 0 if the slot is empty */
+  int workspace;
+  int region;
+  bool configured; /* Whether we know its geometry */
+  uint16_t x, y, width, height; /* As last configured */
+} window_entry_t;
+/* Unchecked request, remembered so asynchronous X errors can be explained */
+typedef struct {
+  unsigned int sequence;
+  const char *operation;
+  xcb_window_t window;
+} request_record_t;
+/* Outstanding reply, handed to its handler once the server answers */
+typedef struct {
+  unsigned int sequence;
+  void (*handler)(
+      void *reply, xcb_generic_error_t *error,
+      xcb_window_t window, uint32_t data
+  );
+  xcb_window_t window;
+  uint32_t data;
+} continuation_t;
+/*
+What the window manager needs from the X server. Requests return their
+sequence number, replies are collected with it like in libxcb.
+*/
+typedef struct {
+  unsigned int (*configure_window)(
+      xcb_window_t window, uint16_t value_mask, const uint32_t *value_list
+  );
+  unsigned int (*map_window)(xcb_window_t window);
+  unsigned int (*unmap_window)(xcb_window_t window);
+  unsigned int (*send_event)(xcb_window_t window, const void *event);
+  unsigned int (*grab_key)(
+      xcb_window_t window, uint16_t modifiers, xcb_keycode_t keycode
+  );
+  unsigned int (*grab_server)(void);
+  unsigned int (*ungrab_server)(void);
+  unsigned int (*get_window_attributes)(xcb_window_t window);
+  unsigned int (*get_input_focus)(void);
+  unsigned int (*change_event_mask)(xcb_window_t window, uint32_t event_mask);
+  bool (*poll_for_reply)(
+      unsigned int sequence, void **reply, xcb_generic_error_t **error
+  );
+  void *(*wait_for_reply)(unsigned int sequence, xcb_generic_error_t **error);
+  xcb_generic_event_t *(*poll_for_event)(void);
+  xcb_generic_event_t *(*poll_for_queued_event)(void);
+  void (*flush)(void);
+  int (*connection_error)(void);
+} backend_t;
+/* Requests sent through a backend */
+typedef enum {
+  REQUEST_CONFIGURE_WINDOW,
+  REQUEST_MAP_WINDOW,
+  REQUEST_UNMAP_WINDOW,
+  REQUEST_SEND_EVENT,
+  REQUEST_GRAB_KEY,
+  REQUEST_GRAB_SERVER,
+  REQUEST_UNGRAB_SERVER,
+  REQUEST_GET_WINDOW_ATTRIBUTES,
+  REQUEST_GET_INPUT_FOCUS,
+  REQUEST_CHANGE_EVENT_MASK,
+  NUM_REQUEST_TYPES
+} request_type_t;
+/* Request the fake server has recorded */
+typedef struct {
+  unsigned int sequence;
+  request_type_t type;
+  xcb_window_t window;
+  uint16_t value_mask;
+} fake_request_t;
+/* Start of a trace file */
+typedef struct {
+  char magic[8]; /* TRACE_MAGIC */
+  uint32_t version;
+  uint16_t width, height; /* Of the screen */
+} trace_header_t;
+/* What a trace record holds */
+typedef enum {
+  TRACE_EVENT, /* Dispatched to EVENT_HANDLERS */
+  TRACE_REQUEST, /* Sent in response */
+  TRACE_BATCH /* The end of a batch, where it was laid out and flushed */
+} trace_kind_t;
+/* Fixed-size record, so a trace can be read back without parsing */
+typedef struct {
+  uint64_t time; /* ns since recording started */
+  uint32_t kind;
+  uint32_t sequence;
+  union {
+    uint8_t event[32]; /* As it came off the wire */
+    struct {
+      uint32_t type; /* request_type_t */
+      xcb_window_t window;
+      uint32_t value_mask;
+    } request;
+  };
+} trace_record_t;
+
+/* Work to be done later, on the event loop */
+typedef struct {
+  uint64_t deadline; /* Monotonic time in ns */
+  void (*callback)(void);
+} deferred_t;
+
+/* Process we launched, kept until it's reaped */
+typedef struct {
+  pid_t pid; /* 0 until the launch has gone through */
+  uint32_t launch_id;
+  char *command; /* argv joined with spaces */
+  int workspace; /* That it was launched on */
+  uint64_t launch_time;
+} child_t;
+/* Counts of launched processes */
+typedef struct {
+  int launched;
+  int failed_launches;
+  int exited; /* With status 0 */
+  int failed; /* With a non-zero status */
+  int killed; /* By a signal */
+  uint64_t launch_time_total, launch_time_max; /* From dispatch to exec */
+} child_stats_t;
+/* Launch request for the launcher, followed by argv as C strings */
+typedef struct {
+  uint32_t id;
+  int32_t workspace;
+  uint32_t argc;
+} launch_request_t;
+/* Launch request waiting for room in the launcher's socket */
+typedef struct {
+  size_t size;
+  char *message;
+} queued_launch_t;
+/* Message from the launcher */
+typedef enum {
+  LAUNCHER_LAUNCHED,
+  LAUNCHER_FAILED, /* status is an errno */
+  LAUNCHER_EXITED /* status is from waitpid() */
+} launcher_reply_type_t;
+typedef struct {
+  launcher_reply_type_t type;
+  uint32_t id;
+  int32_t pid;
+  int32_t status;
+} launcher_reply_t;
+/* Program the launcher has found in PATH */
+typedef struct {
+  char name[64];
+  char path[PATH_MAX];
+} resolved_path_t;
+
+/* Latencies, in buckets a quarter of a power of two wide, like HDR */
+#define HISTOGRAM_SUB_BUCKETS 4
+#define HISTOGRAM_BUCKETS (40 * HISTOGRAM_SUB_BUCKETS) /* Up to ~18 minutes */
+typedef struct {
+  uint32_t counts[HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t total; /* ns */
+  uint64_t max; /* ns */
+} histogram_t;
+/* Counters for where the event loop's time goes */
+typedef struct {
+  uint64_t replies_awaited; /* Continuations queued, mostly pipelined */
+  uint64_t blocking_waits; /* Times we stopped until the server answered */
+  uint64_t batches;
+  uint64_t relayouts; /* Layout passes that had something to do */
+  uint64_t regions_laid_out;
+} loop_stats_t;
 
 /* Keymap data */
 typedef union {
@@ -66,6 +262,99 @@ typedef struct {
   void (*handler)(xcb_key_press_event_t *event, keymap_data_t data);
   keymap_data_t data;
 } keymap_t;
+/* Entry in the keysym to keycode index */
+typedef struct {
+  xkb_keysym_t keysym;
+  xkb_keycode_t keycode;
+} keysym_entry_t;
+/* What follows a control command's name */
+typedef enum {
+  IPC_ARGS_NONE,
+  IPC_ARGS_WORKSPACE,
+  IPC_ARGS_WINDOW,
+  IPC_ARGS_WINDOW_WORKSPACE,
+  IPC_ARGS_WINDOW_FACTOR,
+  IPC_ARGS_COMMAND /* The rest is argv */
+} ipc_args_t;
+/* Control command, run by the same handler as its keymap */
+typedef struct {
+  const char *name;
+  ipc_args_t args;
+  const char *usage;
+  void (*handler)(xcb_key_press_event_t *event, keymap_data_t data);
+} ipc_command_t;
+/* Streams a control connection can subscribe to */
+typedef enum {
+  IPC_TOPIC_WORKSPACE = 1 << 0,
+  IPC_TOPIC_WINDOW = 1 << 1,
+  IPC_TOPIC_FOCUS = 1 << 2,
+  IPC_TOPIC_LAYOUT = 1 << 3
+} ipc_topic_t;
+/* Message on a subscription, in native byte order */
+typedef enum {
+  IPC_EVENT_WORKSPACE, /* window is the previous workspace */
+  IPC_EVENT_WINDOW_MANAGED, /* Again on another workspace, if it moved */
+  IPC_EVENT_WINDOW_UNMANAGED,
+  IPC_EVENT_FOCUS,
+  IPC_EVENT_LAYOUT /* Followed by an ipc_layout_entry_t per window */
+} ipc_event_type_t;
+typedef struct {
+  uint16_t length; /* Of the whole message, this header included */
+  uint16_t type;
+  uint32_t workspace;
+  uint32_t window;
+} ipc_event_t;
+typedef struct {
+  uint32_t window;
+  uint16_t x, y, width, height;
+} ipc_layout_entry_t;
+/* Connection to the control socket */
+typedef struct {
+  int fd; /* -1 if unused */
+  size_t length;
+  char buffer[4096]; /* Input not yet ended by a newline */
+  int topics; /* Once subscribed, replies stop and only events are sent */
+  size_t queued;
+  /*
+  Events not yet sent, it's dropped when this fills. Twice the largest
+  message, so a full layout still fits with other events around it.
+  */
+  char queue[2 * 65536];
+  bool blocked; /* Waiting for it to be writable */
+  int reply_fd; /* Sent along with the next reply, -1 if none */
+} ipc_client_t;
+/*
+State snapshot for observers to mmap. generation is odd while it's being
+written: read it, copy what's needed, then read it again, and retry if
+it was odd or has changed. size only grows, remap when it's bigger than
+what's mapped. The header is followed by num_workspaces workspaces, then
+their regions, indexed as in regions[][] from each one's first_region.
+*/
+typedef struct {
+  int32_t root; /* -1 if it's empty */
+  uint32_t first_region;
+  uint32_t num_regions;
+} state_workspace_t;
+typedef struct {
+  uint32_t magic; /* STATE_MAGIC */
+  uint32_t version;
+  uint32_t generation;
+  uint32_t size; /* Of the whole segment */
+  uint32_t region_size; /* sizeof(state_region_t) */
+  uint32_t workspace; /* Current */
+  uint32_t focused_window; /* 0 if none */
+  uint16_t width, height; /* Of the screen */
+  uint32_t num_workspaces;
+} state_header_t;
+typedef struct {
+  uint32_t window; /* 0 for splits */
+  int32_t parent, child0, child1; /* -1 if none */
+  uint8_t exists; /* Otherwise the rest is meaningless */
+  uint8_t split; /* direction_t */
+  uint8_t configured; /* For windows, whether x, y, width, height are valid */
+  uint16_t x, y, width, height; /* Where it was last put */
+  float factor;
+} state_region_t;
 
 /* Keymap handler declaractions */
 static void handle_keymap_quit(
@@ -92,15 +381,45 @@ static void handle_keymap_workspace(
 static void handle_keymap_windowtoworkspace(
     xcb_key_press_event_t *event, keymap_data_t data
 );
+static void handle_keymap_movetoworkspace(
+    xcb_key_press_event_t *event, keymap_data_t data
+);
+static void handle_keymap_dumpstats(
+    xcb_key_press_event_t *event, keymap_data_t data
+);
+static void handle_keymap_restart(
+    xcb_key_press_event_t *event, keymap_data_t data
+);
 
 /* Settings */
 #define ANSI_LOGS 1
 #define RESIZE_FACTOR 0.025f
-#define MAX_REGIONS 100
+#define MIN_SPLIT_FACTOR 0.05f /* Smallest share of a split either side gets */
+#define FRAME_TIME 16.667 /* ms */
+#define REQUEST_HISTORY 256
+#define MAX_CONTINUATIONS 256
+#define MAX_FDS 1024
+#define MAX_DEFERRED 32
+#define NUM_EVENT_TYPES 128
+#define FAKE_REQUEST_LOG 1024
+#define FAKE_EVENT_QUEUE 1024
+#define MICROBENCH_WINDOWS 1024
+#define MICROBENCH_ROUNDS 1000
+#define LOG_BUFFER_SIZE 65536
+#define LOG_LINE_SIZE 512
+#define FAKE_OVERRIDE_WINDOWS 64
+#define TRACE_MAGIC "WMTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE 65536
+#define USE_LAUNCHER 1
+#define LAUNCH_MESSAGE_SIZE 4096
+#define MAX_LAUNCH_ARGS 64
+#define MAX_RESOLVED_PATHS 16
 #define NUM_WORKSPACES 10
 #define MOD1 XCB_MOD_MASK_1
 #define MOD4 XCB_MOD_MASK_4
 #define SHIFT XCB_MOD_MASK_SHIFT
+#define IGNORED_MODIFIERS (XCB_MOD_MASK_LOCK | numlock_mask)
 const char *termargv[] = { "st", NULL };
 const char *dmenuargv[] = { "dmenu_run", "-m", "0", NULL };
 const char *browserargv[] = { "min-browser", NULL };
@@ -109,6 +428,7 @@ const char *runscriptargv[] = {
 };
 const keymap_t KEYMAPS[] = {
   { MOD1|SHIFT, XKB_KEY_c, handle_keymap_quit, { .i32 = 0 } },
+  { MOD1|SHIFT, XKB_KEY_r, handle_keymap_restart, { .i32 = 0 } },
   { MOD1|SHIFT, XKB_KEY_q, handle_keymap_close, { .i32 = 0} },
   { MOD1, XKB_KEY_Return, handle_keymap_spawnprocess, { .ptr = termargv } },
   { MOD1, XKB_KEY_d, handle_keymap_spawnprocess, { .ptr = dmenuargv } },
@@ -134,6 +454,30 @@ const keymap_t KEYMAPS[] = {
 #undef WORKSPACE_KEYMAPS
 };
 #define NUM_KEYMAPS ((int)(sizeof(KEYMAPS)/sizeof(keymap_t)))
+#define KEYMAP_MODIFIERS(state) ((state) & 0xff & ~IGNORED_MODIFIERS)
+#define MAX_IPC_CLIENTS 16
+#define STATE_MAGIC 0x54534d57 /* "WMST" */
+#define STATE_VERSION 1
+const ipc_command_t IPC_COMMANDS[] = {
+  { "quit", IPC_ARGS_NONE, "quit", handle_keymap_quit },
+  { "close", IPC_ARGS_WINDOW, "close WINDOW", handle_keymap_close },
+  { "spawn", IPC_ARGS_COMMAND, "spawn PROGRAM [ARG...]",
+    handle_keymap_spawnprocess },
+  { "togglesplitdir", IPC_ARGS_WINDOW, "togglesplitdir WINDOW",
+    handle_keymap_togglesplitdir },
+  { "swapsplit", IPC_ARGS_WINDOW, "swapsplit WINDOW",
+    handle_keymap_swapsplit },
+  { "incsplitfactor", IPC_ARGS_WINDOW_FACTOR, "incsplitfactor WINDOW DELTA",
+    handle_keymap_incsplitfactor },
+  { "workspace", IPC_ARGS_WORKSPACE, "workspace WORKSPACE",
+    handle_keymap_workspace },
+  /* Unlike the keymap, this doesn't follow the window to its workspace */
+  { "windowtoworkspace", IPC_ARGS_WINDOW_WORKSPACE,
+    "windowtoworkspace WINDOW WORKSPACE", handle_keymap_movetoworkspace },
+  { "stats", IPC_ARGS_NONE, "stats", handle_keymap_dumpstats },
+  { "restart", IPC_ARGS_NONE, "restart", handle_keymap_restart }
+};
+#define NUM_IPC_COMMANDS ((int)(sizeof(IPC_COMMANDS)/sizeof(ipc_command_t)))
 
 /* Constants */
 const char *LOG_LEVELS[] = {
@@ -149,45 +493,338 @@ const char *LOG_LEVELS[] = {
 #undef ADD_LEVEL
 #endif
 };
+const char *ATOM_NAMES[] = {
+#define ADD_ATOM(name) [ATOM_##name] = #name,
+  ADD_ATOM(WM_PROTOCOLS)
+  ADD_ATOM(WM_DELETE_WINDOW)
+#undef ADD_ATOM
+};
 
 /* Global state */
 static bool running = false;
+static bool restarting = false; /* Exec ourselves once the loop stops */
+static char executable_path[PATH_MAX] = ""; /* What to exec to restart */
+static int restore_fd = -1; /* State left by the instance we restarted from */
+static log_level_t log_level = LOG_LEVEL_INFO; /* Anything less is dropped */
+static char log_buffer[LOG_BUFFER_SIZE]; /* Ring, waiting to go to stdout */
+static size_t log_start = 0;
+static size_t log_size = 0;
+static int log_dropped = 0; /* Messages that didn't fit */
+static char log_last[LOG_LINE_SIZE]; /* For spotting repeats */
+static log_level_t log_last_level = LOG_LEVEL_INFO;
+static int log_repeats = 0;
+static bool log_blocked = false; /* Waiting for stdout to be writable */
+static const backend_t *backend = NULL;
 static xcb_connection_t *connection = NULL;
 static const xcb_setup_t *setup = NULL;
 static xcb_screen_t *screen = NULL;
 static xcb_window_t root = 0;
-static xcb_atom_t WM_PROTOCOLS = 0;
-static xcb_atom_t WM_DELETE_WINDOW = 0;
+static xcb_atom_t atoms[NUM_ATOMS];
+static xcb_get_modifier_mapping_reply_t *modifier_mapping = NULL;
+static uint16_t numlock_mask = XCB_MOD_MASK_2; /* Usual, if it isn't found */
 static struct xkb_context *xkb_context = NULL;
 static struct xkb_keymap *xkb_keymap = NULL;
 static struct xkb_state *xkb_state = NULL;
-static region_t regions[NUM_WORKSPACES][MAX_REGIONS];
+static int16_t keymap_table[256][256]; /* Index into KEYMAPS + 1 */
+static keysym_entry_t *keysym_index = NULL; /* Sorted by keysym */
+static int keysym_index_size = 0;
+static region_t *regions[NUM_WORKSPACES]; /* Grown as needed */
+static int region_capacity[NUM_WORKSPACES];
 static int root_regions[NUM_WORKSPACES]; /* = -1 */
+static int free_regions[NUM_WORKSPACES]; /* = -1 */
 static int workspace = 1;
+static window_entry_t *window_index = NULL;
+static int window_index_capacity = 0; /* Always a power of two */
+static int window_index_size = 0;
+static request_record_t request_history[REQUEST_HISTORY];
+static continuation_t continuations[MAX_CONTINUATIONS];
+static int first_continuation = 0;
+static int num_continuations = 0;
+static uint64_t switch_start_time = 0;
+static bool switching = false; /* Server grabbed for workspace switches */
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static int timer_fd = -1;
+static sigset_t original_sigmask;
+static void (*fd_handlers[MAX_FDS])(int fd, uint32_t events);
+static deferred_t deferred[MAX_DEFERRED];
+static int num_deferred = 0;
+static child_t *children = NULL;
+static int num_children = 0;
+static int children_capacity = 0;
+static child_stats_t child_stats = { 0 };
+static int devnull_fd = -1;
+static posix_spawn_file_actions_t spawn_file_actions;
+static posix_spawnattr_t spawn_attributes;
+static uint64_t dispatch_time = 0; /* When the current event was dispatched */
+static int launcher_fd = -1;
+static pid_t launcher_pid = -1;
+static uint32_t last_launch_id = 0;
+static queued_launch_t *queued_launches = NULL; /* Oldest first */
+static int num_queued_launches = 0;
+static int queued_launches_capacity = 0;
+static resolved_path_t resolved_paths[MAX_RESOLVED_PATHS]; /* Launcher only */
+static int num_resolved_paths = 0;
+static histogram_t event_latencies[NUM_EVENT_TYPES];
+static histogram_t keymap_latencies[NUM_KEYMAPS];
+static histogram_t ipc_latencies[NUM_IPC_COMMANDS];
+static uint64_t event_counts[NUM_EVENT_TYPES];
+static uint64_t dumped_event_counts[NUM_EVENT_TYPES]; /* At the last dump */
+static uint64_t dump_time = 0;
+static uint64_t dumped_requests = 0;
+static loop_stats_t loop_stats = { 0 };
+static int ipc_fd = -1;
+static char ipc_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static ipc_client_t ipc_clients[MAX_IPC_CLIENTS];
+static int ipc_topics = 0; /* Subscribed to by anyone */
+static bool layout_changed = false; /* Since subscribers were last told */
+static uint64_t layout_time = 0; /* When they were */
+static xcb_window_t focused_window = 0;
+static int state_fd = -1;
+static state_header_t *state = NULL; /* Mapped state_fd */
+static size_t state_size = 0;
+static uint32_t state_generation = 0;
+static bool state_changed = false; /* Since it was last published */
+static unsigned int fake_sequence = 0;
+static int fake_request_counts[NUM_REQUEST_TYPES];
+static fake_request_t fake_requests[FAKE_REQUEST_LOG]; /* By sequence */
+static xcb_generic_event_t fake_events[FAKE_EVENT_QUEUE];
+static int first_fake_event = 0;
+static int num_fake_events = 0;
+static xcb_screen_t fake_screen;
+static xcb_window_t fake_override_windows[FAKE_OVERRIDE_WINDOWS]; /* Ring */
+static int num_fake_override_windows = 0;
+static uint64_t requests_sent = 0;
+static FILE *trace_file = NULL;
+static uint64_t trace_start_time = 0;
+static bool trace_pending = false; /* Written to since the last batch */
+static bool replaying = false;
 
 /* Helper function declaractions */
 static void log_msg(log_level_t level, const char *format, ...)
     __attribute__((format(printf, 2, 3)));
+static void init_log(void);
+static int parse_log_level(const char *name);
+static void append_log(const char *text, size_t length);
+static void append_log_line(log_level_t level, const char *message);
+static void finish_repeats(void);
+static void flush_log(bool block);
+static void handle_log_output(int fd, uint32_t events);
+static void init_launcher(void);
+static void start_launcher(void);
+static void stop_launcher(void);
+static void lose_launcher(void);
+static const char *resolve_path(const char *name);
+static void forget_path(const char *name);
+static int spawn_resolved(pid_t *pid, char **argv);
+static void run_launcher(int fd) __attribute__((noreturn));
+static void decode_launch_request(
+    char *message, size_t size, launch_request_t *request, char **argv
+);
 static void spawn_process_quiet(char **argv);
-static void connect(void);
+static void spawn_directly(int child, char **argv);
+static bool request_launch(int child, char **argv);
+static void queue_launch(const char *message, size_t size);
+static bool send_queued_launches(void);
+static void watch_launcher_output(bool watch);
+static void handle_launcher(int fd, uint32_t events);
+static int add_child(char **argv);
+static void launch_succeeded(int child, pid_t pid);
+static void launch_failed(int child, int error);
+static void child_exited(int child, pid_t pid, int status);
+static void reap_children(void);
+static void dump_stats(void);
+static void init_ipc(void);
+static void stop_ipc(void);
+static void handle_ipc_listener(int fd, uint32_t events);
+static void handle_ipc_client(int fd, uint32_t events);
+static void close_ipc_client(ipc_client_t *client);
+static void run_ipc_line(ipc_client_t *client, char *line);
+static bool run_ipc_command(
+    ipc_client_t *client, char *command, char *error, size_t error_size
+);
+static bool subscribe_ipc_client(
+    ipc_client_t *client, char **topics, int num_topics
+);
+static void update_ipc_topics(void);
+static void publish_ipc_event(
+    ipc_event_type_t type, uint32_t ws, uint32_t window
+);
+static void publish_layout(void);
+static void queue_ipc_message(
+    ipc_client_t *client, const void *message, size_t size
+);
+static void flush_ipc_client(ipc_client_t *client);
+static void flush_ipc_clients(void);
+static void watch_ipc_output(ipc_client_t *client, bool watch);
+static bool parse_ipc_window(const char *word, xcb_window_t *window);
+static void init_state(void);
+static void restore_state(int fd);
+static void map_snapshot_windows(const state_header_t *old, size_t size);
+static void check_restored_window(
+    void *reply, xcb_generic_error_t *error,
+    xcb_window_t window, uint32_t data
+);
+static void find_executable(const char *name);
+static void restart(int argc, char *argv[]);
+static bool grow_state(size_t size);
+static void publish_state(void);
+static bool parse_ipc_workspace(const char *word, int *ws);
+static int histogram_bucket(uint64_t value);
+static uint64_t histogram_bucket_limit(int bucket);
+static void record_latency(histogram_t *histogram, uint64_t latency);
+static uint64_t histogram_percentile(
+    const histogram_t *histogram, double percentile
+);
+static void log_histogram(
+    const char *name, const histogram_t *histogram, double rate
+);
+static void connect_to_server(void);
+static unsigned int x_configure_window(
+    xcb_window_t window, uint16_t value_mask, const uint32_t *value_list
+);
+static unsigned int x_map_window(xcb_window_t window);
+static unsigned int x_unmap_window(xcb_window_t window);
+static unsigned int x_send_event(xcb_window_t window, const void *event);
+static unsigned int x_grab_key(
+    xcb_window_t window, uint16_t modifiers, xcb_keycode_t keycode
+);
+static unsigned int x_grab_server(void);
+static unsigned int x_ungrab_server(void);
+static unsigned int x_get_window_attributes(xcb_window_t window);
+static unsigned int x_get_input_focus(void);
+static unsigned int x_change_event_mask(
+    xcb_window_t window, uint32_t event_mask
+);
+static bool x_poll_for_reply(
+    unsigned int sequence, void **reply, xcb_generic_error_t **error
+);
+static void *x_wait_for_reply(
+    unsigned int sequence, xcb_generic_error_t **error
+);
+static xcb_generic_event_t *x_poll_for_event(void);
+static xcb_generic_event_t *x_poll_for_queued_event(void);
+static void x_flush(void);
+static int x_connection_error(void);
+static unsigned int sent_request(
+    request_type_t type, xcb_window_t window, uint16_t value_mask,
+    unsigned int sequence
+);
+static void start_recording(const char *path);
+static void write_trace_header(void);
+static void write_trace(trace_record_t *record);
+static void trace_event(const xcb_generic_event_t *event);
+static void trace_batch(void);
+static int run_replay(const char *path);
+static void init_fake_server(void);
+static void fake_add_override_window(xcb_window_t window);
+static bool fake_is_override_window(xcb_window_t window);
+static unsigned int fake_record(
+    request_type_t type, xcb_window_t window, uint16_t value_mask
+);
+static void fake_inject_event(const void *event, size_t size);
+static unsigned int fake_configure_window(
+    xcb_window_t window, uint16_t value_mask, const uint32_t *value_list
+);
+static unsigned int fake_map_window(xcb_window_t window);
+static unsigned int fake_unmap_window(xcb_window_t window);
+static unsigned int fake_send_event(xcb_window_t window, const void *event);
+static unsigned int fake_grab_key(
+    xcb_window_t window, uint16_t modifiers, xcb_keycode_t keycode
+);
+static unsigned int fake_grab_server(void);
+static unsigned int fake_ungrab_server(void);
+static unsigned int fake_get_window_attributes(xcb_window_t window);
+static unsigned int fake_get_input_focus(void);
+static unsigned int fake_change_event_mask(
+    xcb_window_t window, uint32_t event_mask
+);
+static bool fake_poll_for_reply(
+    unsigned int sequence, void **reply, xcb_generic_error_t **error
+);
+static void *fake_wait_for_reply(
+    unsigned int sequence, xcb_generic_error_t **error
+);
+static xcb_generic_event_t *fake_poll_for_event(void);
+static void fake_flush(void);
+static int fake_connection_error(void);
 static void cleanup(void);
 static void get_setup_info(void);
-static xcb_atom_t get_atom(const char *name);
+static uint64_t get_time_ns(void);
+static void intern_atoms(void);
+static void adopt_windows(void);
 static void set_event_mask(xcb_window_t window, uint32_t event_mask);
+static void track_request(
+    unsigned int sequence, const char *operation, xcb_window_t window
+);
+static void await_reply(
+    unsigned int sequence,
+    void (*handler)(
+        void *reply, xcb_generic_error_t *error,
+        xcb_window_t window, uint32_t data
+    ),
+    xcb_window_t window, uint32_t data
+);
+static bool finish_continuation(bool block);
+static bool process_continuations(void);
+static void dispatch_event(xcb_generic_event_t *event);
+static void init_event_loop(void);
+static void watch_fd(
+    int fd, uint32_t events, void (*handler)(int fd, uint32_t events)
+);
+static void unwatch_fd(int fd);
+static void wait_for_events(void);
+static void finish_batch(void);
+static void defer(uint64_t delay_ns, void (*callback)(void));
+static void arm_timer(void);
+static void handle_connection(int fd, uint32_t events);
+static void handle_signal(int fd, uint32_t events);
+static void handle_timer(int fd, uint32_t events);
 static void init_xkb(void);
-static void grab_keymap(uint16_t modifiers, xkb_keysym_t keysym);
+static int compare_keysym_entries(const void *a, const void *b);
+static void index_keysyms(void);
+static int find_keysym(xkb_keysym_t keysym);
+static void find_numlock(void);
+static void grab_keymap(int keymap);
 static void change_window_rect(
     xcb_window_t window, uint16_t x, uint16_t y, uint16_t width, uint16_t height
 );
-static int get_empty_region(void);
+static uint32_t hash_window(xcb_window_t window);
+static window_entry_t *find_window(xcb_window_t window);
+static void grow_window_index(void);
+static void index_window(xcb_window_t window, int ws, int region);
+static void unindex_window(xcb_window_t window);
+static int get_empty_region(int ws);
+static void free_region(int ws, int region);
+static void mark_dirty(int ws, int region);
 static void refresh_layout(
     int region, uint16_t x, uint16_t y, uint16_t width, uint16_t height
 );
-static void add_region(xcb_window_t parent, xcb_window_t window);
-static void remove_region(int region);
-static bool window_isfloat(xcb_window_t window);
+static void update_layout(void);
+static void add_region(int ws, xcb_window_t parent, xcb_window_t window);
+static void remove_region(int ws, int region);
+static bool window_isfloat(
+    const xcb_get_window_attributes_reply_t *attributes
+);
+static void manage_window(
+    void *reply, xcb_generic_error_t *error,
+    xcb_window_t window, uint32_t parent_window
+);
+static void end_workspace_switches(void);
+static void finish_workspace_switch(
+    void *reply, xcb_generic_error_t *error,
+    xcb_window_t window, uint32_t new_workspace
+);
+static bool check_requests(
+    const char *operation, request_type_t type, int expected
+);
+static int run_microbench(void);
 
 /* Event handler declaractions */
+static void handle_error(xcb_generic_error_t *error);
+static void event_handler_ERROR(xcb_generic_event_t *event) {
+  handle_error((xcb_generic_error_t *)event);
+}
 #define DECLARE_HANDLER(event, ident)\
 static void handle_##ident (xcb_##ident##_event_t *event);\
 static void event_handler_##event (xcb_generic_event_t *event) {\
@@ -209,6 +846,7 @@ DECLARE_HANDLER(FOCUS_IN, focus_in)
 DECLARE_HANDLER(FOCUS_OUT, focus_out)
 #undef DECLARE_HANDLER
 static void (*EVENT_HANDLERS[])(xcb_generic_event_t *) = {
+  [0] = event_handler_ERROR,
 #define ADD_HANDLER(event) [XCB_##event] = event_handler_##event,
   ADD_HANDLER(CREATE_NOTIFY)
   ADD_HANDLER(DESTROY_NOTIFY)
@@ -226,15 +864,115 @@ static void (*EVENT_HANDLERS[])(xcb_generic_event_t *) = {
   ADD_HANDLER(FOCUS_OUT)
 #undef ADD_HANDLER
 };
+static const char *EVENT_NAMES[] = {
+  [0] = "ERROR",
+#define ADD_NAME(event) [XCB_##event] = #event,
+  ADD_NAME(CREATE_NOTIFY)
+  ADD_NAME(DESTROY_NOTIFY)
+  ADD_NAME(MAP_NOTIFY)
+  ADD_NAME(UNMAP_NOTIFY)
+  ADD_NAME(REPARENT_NOTIFY)
+  ADD_NAME(CONFIGURE_NOTIFY)
+  ADD_NAME(GRAVITY_NOTIFY)
+  ADD_NAME(MAP_REQUEST)
+  ADD_NAME(CONFIGURE_REQUEST)
+  ADD_NAME(CIRCULATE_REQUEST)
+  ADD_NAME(KEY_PRESS)
+  ADD_NAME(KEY_RELEASE)
+  ADD_NAME(FOCUS_IN)
+  ADD_NAME(FOCUS_OUT)
+#undef ADD_NAME
+};
+
+/* Backends */
+static const backend_t X_BACKEND = {
+  .configure_window = x_configure_window,
+  .map_window = x_map_window,
+  .unmap_window = x_unmap_window,
+  .send_event = x_send_event,
+  .grab_key = x_grab_key,
+  .grab_server = x_grab_server,
+  .ungrab_server = x_ungrab_server,
+  .get_window_attributes = x_get_window_attributes,
+  .get_input_focus = x_get_input_focus,
+  .change_event_mask = x_change_event_mask,
+  .poll_for_reply = x_poll_for_reply,
+  .wait_for_reply = x_wait_for_reply,
+  .poll_for_event = x_poll_for_event,
+  .poll_for_queued_event = x_poll_for_queued_event,
+  .flush = x_flush,
+  .connection_error = x_connection_error
+};
+/* Answers straight away and never goes away, for benchmarks and tests */
+static const backend_t FAKE_BACKEND = {
+  .configure_window = fake_configure_window,
+  .map_window = fake_map_window,
+  .unmap_window = fake_unmap_window,
+  .send_event = fake_send_event,
+  .grab_key = fake_grab_key,
+  .grab_server = fake_grab_server,
+  .ungrab_server = fake_ungrab_server,
+  .get_window_attributes = fake_get_window_attributes,
+  .get_input_focus = fake_get_input_focus,
+  .change_event_mask = fake_change_event_mask,
+  .poll_for_reply = fake_poll_for_reply,
+  .wait_for_reply = fake_wait_for_reply,
+  .poll_for_event = fake_poll_for_event,
+  .poll_for_queued_event = fake_poll_for_event,
+  .flush = fake_flush,
+  .connection_error = fake_connection_error
+};
 
 /* Entry point */
 int main(int argc, char *argv[]) {
+  init_log();
+  const char *replay_path = NULL;
+  bool microbench = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--microbench"))
+      microbench = true;
+    else if (!strcmp(argv[i], "--log-level") && i + 1 < argc) {
+      int level = parse_log_level(argv[++i]);
+      if (level >= 0) log_level = level;
+    } else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+      start_recording(argv[++i]);
+    else if (!strcmp(argv[i], "--replay") && i + 1 < argc)
+      replay_path = argv[++i];
+    else if (!strcmp(argv[i], "--restore-fd") && i + 1 < argc) {
+      restore_fd = atoi(argv[++i]);
+      /* It had to survive one exec, but nothing we spawn should get it */
+      if (fcntl(restore_fd, F_SETFD, FD_CLOEXEC) < 0) restore_fd = -1;
+    } else {
+      log_msg(
+          LOG_LEVEL_WARNING,
+          "Usage: %s [--log-level LEVEL] [--microbench] [--record FILE] "
+          "[--replay FILE] [--restore-fd FD]",
+          argv[0]
+      );
+      flush_log(true);
+      return 1;
+    }
+  }
+  if (microbench || replay_path) {
+    int status = microbench ? run_microbench() : run_replay(replay_path);
+    flush_log(true);
+    return status;
+  }
+
   /* Startup */
+  uint64_t startup_time = get_time_ns();
   log_msg(LOG_LEVEL_INFO, "Starting...");
-  connect();
+  find_executable(argv[0]);
+  init_launcher();
+#if USE_LAUNCHER
+  start_launcher();
+#endif
+  connect_to_server();
+  init_event_loop();
+  init_ipc();
   get_setup_info();
-  WM_PROTOCOLS = get_atom("WM_PROTOCOLS");
-  WM_DELETE_WINDOW = get_atom("WM_DELETE_WINDOW");
+  if (trace_file) write_trace_header();
+  intern_atoms();
   set_event_mask(
       root,
       XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT
@@ -245,24 +983,35 @@ int main(int argc, char *argv[]) {
   );
   init_xkb();
   for (int i = 0; i < NUM_KEYMAPS; i++)
-    grab_keymap(KEYMAPS[i].modifiers, KEYMAPS[i].keysym);
-  /* Set each root_region to -1 */
-  for (int i = 0; i < NUM_WORKSPACES; i++)
+    grab_keymap(i);
+  /* Set each root_region and free_region to -1 */
+  for (int i = 0; i < NUM_WORKSPACES; i++) {
     root_regions[i] = -1;
+    free_regions[i] = -1;
+  }
+  if (restore_fd >= 0) {
+    restore_state(restore_fd);
+    restore_fd = -1;
+  }
+  init_state();
+  adopt_windows();
+
+  log_msg(
+      LOG_LEVEL_INFO, "Started in %.3fms",
+      (get_time_ns() - startup_time) / 1e6
+  );
+  dump_time = get_time_ns();
 
   /* Event loop */
   log_msg(LOG_LEVEL_INFO, "Processing events...");
   running = true;
   while (running) {
-    xcb_generic_event_t *event = xcb_wait_for_event(connection);
-    uint8_t type = event->response_type & ~0x80;
-    if (type < (sizeof(EVENT_HANDLERS)/sizeof(EVENT_HANDLERS[0])))
-      if (EVENT_HANDLERS[type])
-        EVENT_HANDLERS[type](event);
-    free(event);
+    finish_batch();
+    wait_for_events();
   }
 
   /* Cleanup */
+  if (restarting) restart(argc, argv);
   log_msg(LOG_LEVEL_INFO, "Cleaning up...");
   cleanup();
   return 0;
@@ -277,29 +1026,18 @@ static void handle_keymap_quit(
 static void handle_keymap_close(
     xcb_key_press_event_t *event, keymap_data_t data
 ) {
-  xcb_generic_error_t *error = NULL;
+  if (!event->child) return;
   const xcb_client_message_event_t wm_event = {
     .response_type = XCB_CLIENT_MESSAGE,
     .format = 32,
     .window = event->child,
-    .type = WM_PROTOCOLS,
-    .data.data32 = { WM_DELETE_WINDOW, XCB_CURRENT_TIME, 0, 0, 0 }
+    .type = atoms[ATOM_WM_PROTOCOLS],
+    .data.data32 = { atoms[ATOM_WM_DELETE_WINDOW], XCB_CURRENT_TIME, 0, 0, 0 }
   };
-  xcb_void_cookie_t cookie = xcb_send_event(
-      connection,
-      0, event->child,
-      XCB_EVENT_MASK_NO_EVENT,
-      (const char *)&wm_event
+  track_request(
+      backend->send_event(event->child, &wm_event),
+      "send WM_DELETE_WINDOW to window", event->child
   );
-  error = xcb_request_check(connection, cookie);
-  if (error) {
-    int error_code = error->error_code;
-    free(error);
-    log_msg(
-        LOG_LEVEL_ERROR,
-        "Failed to send WM_DELETE_WINDOW event (%d)", error_code
-    );
-  }
 }
 static void handle_keymap_spawnprocess(
     xcb_key_press_event_t *event, keymap_data_t data
@@ -309,133 +1047,266 @@ static void handle_keymap_spawnprocess(
 static void handle_keymap_togglesplitdir(
     xcb_key_press_event_t *event, keymap_data_t data
 ) {
-  int region = -1;
-  for (int i = 0; i < MAX_REGIONS; i++)
-    if (regions[workspace][i].handle == event->child)
-      region = i;
-  if (region < 0) return;
-  int parent = regions[workspace][region].parent;
+  window_entry_t *entry = find_window(event->child);
+  if (!entry) return;
+  /* Hidden workspaces are laid out again when they're switched to */
+  int ws = entry->workspace;
+  int parent = regions[ws][entry->region].parent;
   if (parent < 0) return;
-  if (regions[workspace][parent].split == DIR_HORIZONTAL)
-    regions[workspace][parent].split = DIR_VERTICAL;
+  if (regions[ws][parent].split == DIR_HORIZONTAL)
+    regions[ws][parent].split = DIR_VERTICAL;
   else
-    regions[workspace][parent].split = DIR_HORIZONTAL;
-  refresh_layout(
-      root_regions[workspace],
-      0, 0, screen->width_in_pixels, screen->height_in_pixels
-  );
+    regions[ws][parent].split = DIR_HORIZONTAL;
+  mark_dirty(ws, parent);
 }
 static void handle_keymap_swapsplit(
     xcb_key_press_event_t *event, keymap_data_t data
 ) {
-  int region = -1;
-  for (int i = 0; i < MAX_REGIONS; i++)
-    if (regions[workspace][i].handle == event->child)
-      region = i;
-  if (region < 0) return;
-  int parent = regions[workspace][region].parent;
+  window_entry_t *entry = find_window(event->child);
+  if (!entry) return;
+  int ws = entry->workspace;
+  int parent = regions[ws][entry->region].parent;
   if (parent < 0) return;
-  int tmp = regions[workspace][parent].child0;
-  regions[workspace][parent].child0 = regions[workspace][parent].child1;
-  regions[workspace][parent].child1 = tmp;
-  refresh_layout(
-      root_regions[workspace],
-      0, 0, screen->width_in_pixels, screen->height_in_pixels
-  );
+  int tmp = regions[ws][parent].child0;
+  regions[ws][parent].child0 = regions[ws][parent].child1;
+  regions[ws][parent].child1 = tmp;
+  mark_dirty(ws, parent);
 }
 static void handle_keymap_incsplitfactor(
     xcb_key_press_event_t *event, keymap_data_t data
 ) {
-  int region = -1;
-  for (int i = 0; i < MAX_REGIONS; i++)
-    if (regions[workspace][i].handle == event->child)
-      region = i;
-  if (region < 0) return;
-  int parent = regions[workspace][region].parent;
+  window_entry_t *entry = find_window(event->child);
+  if (!entry) return;
+  int ws = entry->workspace;
+  int parent = regions[ws][entry->region].parent;
   if (parent < 0) return;
-  regions[workspace][parent].factor += data.f32;
-  if (regions[workspace][parent].factor > 1.0f - data.f32)
-    regions[workspace][parent].factor = 1.0f - data.f32;
-  if (regions[workspace][parent].factor < data.f32)
-    regions[workspace][parent].factor = data.f32;
-  refresh_layout(
-      root_regions[workspace],
-      0, 0, screen->width_in_pixels, screen->height_in_pixels
-  );
+  /* Whichever way it goes, both sides keep some of the space */
+  float factor = regions[ws][parent].factor + data.f32;
+  if (factor < MIN_SPLIT_FACTOR) factor = MIN_SPLIT_FACTOR;
+  if (factor > 1.0f - MIN_SPLIT_FACTOR) factor = 1.0f - MIN_SPLIT_FACTOR;
+  regions[ws][parent].factor = factor;
+  mark_dirty(ws, parent);
 }
 static void handle_keymap_workspace(
     xcb_key_press_event_t *event, keymap_data_t data
 ) {
-  xcb_generic_error_t *error = NULL;
-  for (int i = 0; i < MAX_REGIONS; i++) {
+  if (data.i32 == workspace) return;
+  /*
+  Send the whole switch as one burst with the server grabbed, so it's
+  drawn all at once: lay out the new workspace while it's still hidden,
+  map it over the old one, and only then unmap the old one. Several
+  switches in a batch share the grab, finish_batch() ungrabs and flushes.
+  */
+  if (!switching) {
+    switch_start_time = get_time_ns();
+    track_request(backend->grab_server(), "grab server for window", root);
+    switching = true;
+  }
+  int old_workspace = workspace;
+  workspace = data.i32;
+  update_layout();
+  for (int i = 0; i < region_capacity[workspace]; i++) {
     if (
       !(regions[workspace][i].exists)
       || !(regions[workspace][i].handle)
     ) continue;
-    xcb_void_cookie_t cookie = xcb_unmap_window(
-        connection, regions[workspace][i].handle
+    track_request(
+        backend->map_window(regions[workspace][i].handle),
+        "map window", regions[workspace][i].handle
     );
-    error = xcb_request_check(connection, cookie);
-    if (error) {
-      int error_code = error->error_code;
-      free(error);
-      log_msg(
-          LOG_LEVEL_ERROR,
-          "Failed to unmap window (%d)", error_code
-      );
-    }
   }
-  workspace = data.i32;
-  for (int i = 0; i < MAX_REGIONS; i++) {
+  for (int i = 0; i < region_capacity[old_workspace]; i++) {
     if (
-      !(regions[workspace][i].exists)
-      || !(regions[workspace][i].handle)
+      !(regions[old_workspace][i].exists)
+      || !(regions[old_workspace][i].handle)
     ) continue;
-    xcb_void_cookie_t cookie = xcb_map_window(
-        connection, regions[workspace][i].handle
+    track_request(
+        backend->unmap_window(regions[old_workspace][i].handle),
+        "unmap window", regions[old_workspace][i].handle
     );
-    error = xcb_request_check(connection, cookie);
-    if (error) {
-      int error_code = error->error_code;
-      free(error);
-      log_msg(
-          LOG_LEVEL_ERROR,
-          "Failed to map window (%d)", error_code
-      );
-    }
   }
-  if (root_regions[workspace] < 0) return;
-  refresh_layout(
-      root_regions[workspace],
-      0, 0, screen->width_in_pixels, screen->height_in_pixels
-  );
+  publish_ipc_event(IPC_EVENT_WORKSPACE, workspace, old_workspace);
+  state_changed = true;
+  layout_changed = true;
 }
 static void handle_keymap_windowtoworkspace(
     xcb_key_press_event_t *event, keymap_data_t data
 ) {
   if (data.i32 == workspace) return;
-  for (int i = 0; i < MAX_REGIONS; i++)
-    if (regions[workspace][i].handle == event->child)
-      remove_region(i);
+  window_entry_t *entry = find_window(event->child);
+  if (!entry || entry->workspace != workspace) return;
+  remove_region(workspace, entry->region);
+  /* Add it first, so it's laid out as part of the switch */
+  add_region(data.i32, 0, event->child);
+  publish_ipc_event(IPC_EVENT_WINDOW_MANAGED, data.i32, event->child);
   handle_keymap_workspace(event, data);
-  add_region(0, event->child);
-  refresh_layout(
-      root_regions[workspace],
-      0, 0, screen->width_in_pixels, screen->height_in_pixels
-  );
+}
+static void handle_keymap_movetoworkspace(
+    xcb_key_press_event_t *event, keymap_data_t data
+) {
+  /* Whichever workspace it's on, and without switching to another one */
+  window_entry_t *entry = find_window(event->child);
+  if (!entry || entry->workspace == data.i32) return;
+  int old_workspace = entry->workspace;
+  remove_region(old_workspace, entry->region);
+  add_region(data.i32, 0, event->child);
+  publish_ipc_event(IPC_EVENT_WINDOW_MANAGED, data.i32, event->child);
+  if (old_workspace == workspace)
+    track_request(
+        backend->unmap_window(event->child), "unmap window", event->child
+    );
+  else if (data.i32 == workspace)
+    track_request(
+        backend->map_window(event->child), "map window", event->child
+    );
+}
+static void handle_keymap_dumpstats(
+    xcb_key_press_event_t *event, keymap_data_t data
+) {
+  dump_stats();
+}
+static void handle_keymap_restart(
+    xcb_key_press_event_t *event, keymap_data_t data
+) {
+  restarting = true;
+  running = false;
 }
 
 /* Helper function definitions */
 static void log_msg(log_level_t level, const char *format, ...) {
-  fprintf(level == LOG_LEVEL_ERROR ? stderr : stdout, LOG_LEVELS[level]);
+  /*
+  Messages are formatted into a ring and written out by the event loop
+  before it sleeps, so logging never waits on whoever is reading stdout.
+  */
+  if (level < log_level) return;
+  char message[LOG_LINE_SIZE];
   va_list args;
   va_start(args, format);
-  vfprintf(level == LOG_LEVEL_ERROR ? stderr : stdout, format, args);
+  vsnprintf(message, sizeof(message), format, args);
   va_end(args);
-  fprintf(level == LOG_LEVEL_ERROR ? stderr : stdout, "\n");
-  if (level == LOG_LEVEL_ERROR) abort();
+  if (level == LOG_LEVEL_ERROR) {
+    /* Get everything that led up to it out first */
+    flush_log(true);
+    fprintf(stderr, "%s%s\n", LOG_LEVELS[level], message);
+    abort();
+  }
+  /* A storm of the same message is written once, with a count */
+  if (level == log_last_level && !strcmp(message, log_last)) {
+    log_repeats++;
+    return;
+  }
+  finish_repeats();
+  strcpy(log_last, message);
+  log_last_level = level;
+  append_log_line(level, message);
+}
+static void init_log(void) {
+  const char *level = getenv("WM_LOG_LEVEL");
+  if (level && parse_log_level(level) >= 0)
+    log_level = parse_log_level(level);
+  /* If whoever reads the log goes away, writing fails with EPIPE instead */
+  signal(SIGPIPE, SIG_IGN);
+  /* A full pipe would stall us, a terminal or a file won't */
+  struct stat status;
+  if (
+    !fstat(STDOUT_FILENO, &status)
+    && (S_ISFIFO(status.st_mode) || S_ISSOCK(status.st_mode))
+  )
+    fcntl(
+        STDOUT_FILENO, F_SETFL,
+        fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK
+    );
+}
+static int parse_log_level(const char *name) {
+  /* Returns -1 if name isn't a log level */
+  if (!strcmp(name, "info")) return LOG_LEVEL_INFO;
+  if (!strcmp(name, "warning")) return LOG_LEVEL_WARNING;
+  if (!strcmp(name, "error")) return LOG_LEVEL_ERROR;
+  return -1;
+}
+static void append_log(const char *text, size_t length) {
+  size_t end = (log_start + log_size) % LOG_BUFFER_SIZE;
+  size_t first = LOG_BUFFER_SIZE - end;
+  if (first > length) first = length;
+  memcpy(log_buffer + end, text, first);
+  memcpy(log_buffer, text + first, length - first);
+  log_size += length;
+}
+static void append_log_line(log_level_t level, const char *message) {
+  size_t prefix_length = strlen(LOG_LEVELS[level]);
+  size_t length = strlen(message);
+  /* Newer messages are dropped rather than overwriting older ones */
+  if (log_size + prefix_length + length + 1 > LOG_BUFFER_SIZE) {
+    log_dropped++;
+    return;
+  }
+  append_log(LOG_LEVELS[level], prefix_length);
+  append_log(message, length);
+  append_log("\n", 1);
 }
-static void connect(void) {
+static void finish_repeats(void) {
+  if (!log_repeats) return;
+  char message[64];
+  snprintf(
+      message, sizeof(message),
+      "Last message repeated %d more times", log_repeats
+  );
+  log_repeats = 0;
+  append_log_line(log_last_level, message);
+}
+static void flush_log(bool block) {
+  finish_repeats();
+  /* Repeats after a flush are worth showing again */
+  log_last[0] = '\0';
+  while (log_size) {
+    size_t first = LOG_BUFFER_SIZE - log_start;
+    if (first > log_size) first = log_size;
+    struct iovec parts[2] = {
+      { .iov_base = log_buffer + log_start, .iov_len = first },
+      { .iov_base = log_buffer, .iov_len = log_size - first }
+    };
+    ssize_t written = writev(STDOUT_FILENO, parts, 2);
+    if (written < 0 && errno == EINTR) continue;
+    if (written < 0 && errno == EAGAIN) {
+      if (block) {
+        struct pollfd pollfd = { .fd = STDOUT_FILENO, .events = POLLOUT };
+        poll(&pollfd, 1, -1);
+        continue;
+      }
+      /* Try again once it's writable, without holding up the loop */
+      if (!log_blocked && epoll_fd >= 0) {
+        watch_fd(STDOUT_FILENO, EPOLLOUT, handle_log_output);
+        log_blocked = true;
+      }
+      return;
+    }
+    /* Nobody is listening, so there's nowhere for it to go */
+    if (written < 0) {
+      log_size = 0;
+      break;
+    }
+    log_start = (log_start + written) % LOG_BUFFER_SIZE;
+    log_size -= written;
+    if (!log_size && log_dropped) {
+      char message[64];
+      snprintf(
+          message, sizeof(message),
+          "Dropped %d messages while the log was full", log_dropped
+      );
+      log_dropped = 0;
+      append_log_line(LOG_LEVEL_WARNING, message);
+    }
+  }
+  log_start = 0;
+  if (log_blocked) {
+    unwatch_fd(STDOUT_FILENO);
+    log_blocked = false;
+  }
+}
+static void handle_log_output(int fd, uint32_t events) {
+  flush_log(false);
+}
+static void connect_to_server(void) {
   connection = xcb_connect(NULL, NULL);
   int connection_error = xcb_connection_has_error(connection);
   if (connection_error) {
@@ -445,96 +1316,1981 @@ static void connect(void) {
         "Failed to connect to X server (%d)", connection_error
     );
   }
+  backend = &X_BACKEND;
 }
-static void spawn_process_quiet(char **argv) {
-  if (!fork()) {
-    int devnull = open("/dev/null", O_WRONLY);
-    if (devnull < 0)
-      log_msg(
-          LOG_LEVEL_ERROR,
-          "Failed to open /dev/null (%s)", strerror(errno)
-      );
-    dup2(devnull, STDOUT_FILENO);
-    dup2(devnull, STDERR_FILENO);
-    close(devnull);
-
-    execvp(argv[0], argv);
-  }
+static unsigned int x_configure_window(
+    xcb_window_t window, uint16_t value_mask, const uint32_t *value_list
+) {
+  return sent_request(
+      REQUEST_CONFIGURE_WINDOW, window, value_mask,
+      xcb_configure_window(connection, window, value_mask, value_list).sequence
+  );
 }
-static void cleanup(void) {
-  xkb_state_unref(xkb_state);
-  xkb_keymap_unref(xkb_keymap);
-  xkb_context_unref(xkb_context);
-  xcb_disconnect(connection);
+static unsigned int x_map_window(xcb_window_t window) {
+  return sent_request(
+      REQUEST_MAP_WINDOW, window, 0,
+      xcb_map_window(connection, window).sequence
+  );
 }
-static void get_setup_info(void) {
-  setup = xcb_get_setup(connection);
-  if (!setup)
-    log_msg(LOG_LEVEL_ERROR, "Failed to get setup information");
-  log_msg(
-      LOG_LEVEL_INFO, "setup.protocol_major_version = %d",
-      setup->protocol_major_version
+static unsigned int x_unmap_window(xcb_window_t window) {
+  return sent_request(
+      REQUEST_UNMAP_WINDOW, window, 0,
+      xcb_unmap_window(connection, window).sequence
   );
-  log_msg(
-      LOG_LEVEL_INFO, "setup.protocol_minor_version = %d",
-      setup->protocol_minor_version
+}
+static unsigned int x_send_event(xcb_window_t window, const void *event) {
+  return sent_request(
+      REQUEST_SEND_EVENT, window, 0,
+      xcb_send_event(
+          connection, 0, window, XCB_EVENT_MASK_NO_EVENT, event
+      ).sequence
   );
-  xcb_screen_iterator_t screen_iterator = xcb_setup_roots_iterator(setup);
-  screen = screen_iterator.data;
-  log_msg(
-      LOG_LEVEL_INFO, "screen.width_in_millimeters = %d",
-      screen->width_in_millimeters
+}
+static unsigned int x_grab_key(
+    xcb_window_t window, uint16_t modifiers, xcb_keycode_t keycode
+) {
+  return sent_request(
+      REQUEST_GRAB_KEY, window, modifiers,
+      xcb_grab_key(
+          connection, 0, window, modifiers, keycode,
+          XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC
+      ).sequence
   );
-  log_msg(
-      LOG_LEVEL_INFO, "screen.height_in_millimeters = %d",
-      screen->height_in_millimeters
+}
+static unsigned int x_grab_server(void) {
+  return sent_request(
+      REQUEST_GRAB_SERVER, root, 0,
+      xcb_grab_server(connection).sequence
   );
-  log_msg(
-      LOG_LEVEL_INFO, "screen.width_in_pixels = %d",
-      screen->width_in_pixels
+}
+static unsigned int x_ungrab_server(void) {
+  return sent_request(
+      REQUEST_UNGRAB_SERVER, root, 0,
+      xcb_ungrab_server(connection).sequence
   );
-  log_msg(
-      LOG_LEVEL_INFO, "screen.height_in_pixels = %d",
-      screen->height_in_pixels
+}
+static unsigned int x_get_window_attributes(xcb_window_t window) {
+  return sent_request(
+      REQUEST_GET_WINDOW_ATTRIBUTES, window, 0,
+      xcb_get_window_attributes(connection, window).sequence
   );
-  root = screen->root;
 }
-static xcb_atom_t get_atom(const char *name) {
-  /*
-  Theoretically, it would be better to send out requests for each atom,
-  and then gather all the replies, taking advantage of XCB's asynchronous
-  design. In practice, that won't save enough time to be worth the messier
-  implementation.
-  */
-  xcb_generic_error_t *error = NULL;
-  xcb_intern_atom_cookie_t cookie = xcb_intern_atom(
-      connection, 0, strlen(name), name
+static unsigned int x_get_input_focus(void) {
+  return sent_request(
+      REQUEST_GET_INPUT_FOCUS, root, 0,
+      xcb_get_input_focus(connection).sequence
   );
-  xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(
-      connection, cookie, &error
+}
+static unsigned int x_change_event_mask(
+    xcb_window_t window, uint32_t event_mask
+) {
+  return sent_request(
+      REQUEST_CHANGE_EVENT_MASK, window, 0,
+      xcb_change_window_attributes(
+          connection, window, XCB_CW_EVENT_MASK, &event_mask
+      ).sequence
   );
-  if (!reply) {
-    if (error)
-      log_msg(
-          LOG_LEVEL_ERROR,
-          "Failed to get atom: %s (%d)", name, error->error_code
-      );
-    else
-      log_msg(LOG_LEVEL_ERROR, "Failed to get atom: %s", name);
+}
+static bool x_poll_for_reply(
+    unsigned int sequence, void **reply, xcb_generic_error_t **error
+) {
+  return xcb_poll_for_reply(connection, sequence, reply, error);
+}
+static void *x_wait_for_reply(
+    unsigned int sequence, xcb_generic_error_t **error
+) {
+  return xcb_wait_for_reply(connection, sequence, error);
+}
+static xcb_generic_event_t *x_poll_for_event(void) {
+  return xcb_poll_for_event(connection);
+}
+static xcb_generic_event_t *x_poll_for_queued_event(void) {
+  return xcb_poll_for_queued_event(connection);
+}
+static void x_flush(void) {
+  xcb_flush(connection);
+}
+static int x_connection_error(void) {
+  return xcb_connection_has_error(connection);
+}
+static unsigned int sent_request(
+    request_type_t type, xcb_window_t window, uint16_t value_mask,
+    unsigned int sequence
+) {
+  requests_sent++;
+  if (trace_file) {
+    trace_record_t record = {
+      .kind = TRACE_REQUEST,
+      .sequence = sequence,
+      .request = { .type = type, .window = window, .value_mask = value_mask }
+    };
+    write_trace(&record);
   }
-  xcb_atom_t atom = reply->atom;
-  free(reply);
-  if (!atom)
-    log_msg(LOG_LEVEL_ERROR, "Failed to get atom: %s", name);
-  else
-    log_msg(LOG_LEVEL_INFO, "Got atom: %s", name);
-  return atom;
+  return sequence;
 }
-static void set_event_mask(xcb_window_t window, uint32_t event_mask) {
+static void start_recording(const char *path) {
+  /* Opt-in, so the cost of writing records isn't paid otherwise */
+  trace_file = fopen(path, "wb");
+  if (!trace_file)
+    log_msg(
+        LOG_LEVEL_ERROR,
+        "Failed to open trace %s (%s)", path, strerror(errno)
+    );
+  setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+  trace_start_time = get_time_ns();
+  log_msg(LOG_LEVEL_INFO, "Recording trace to %s", path);
+}
+static void write_trace_header(void) {
+  /* Written once the screen is known */
+  trace_header_t header = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .width = screen->width_in_pixels,
+    .height = screen->height_in_pixels
+  };
+  if (fwrite(&header, sizeof(header), 1, trace_file) != 1)
+    log_msg(LOG_LEVEL_ERROR, "Failed to write trace (%s)", strerror(errno));
+}
+static void write_trace(trace_record_t *record) {
+  record->time = get_time_ns() - trace_start_time;
+  if (fwrite(record, sizeof(*record), 1, trace_file) != 1) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to write trace (%s), stopping recording", strerror(errno)
+    );
+    fclose(trace_file);
+    trace_file = NULL;
+    return;
+  }
+  trace_pending = true;
+}
+static void trace_event(const xcb_generic_event_t *event) {
+  trace_record_t record = {
+    .kind = TRACE_EVENT,
+    .sequence = event->full_sequence
+  };
+  memcpy(record.event, event, sizeof(record.event));
+  write_trace(&record);
+}
+static void trace_batch(void) {
+  /* Idle wakeups aren't worth a record, or a write */
+  if (!trace_pending) return;
+  trace_record_t record = { .kind = TRACE_BATCH };
+  write_trace(&record);
+  trace_pending = false;
+  if (trace_file) fflush(trace_file);
+}
+static int run_replay(const char *path) {
+  /*
+  Feeds a recorded trace back through the event handlers as fast as they
+  go, laying out and flushing wherever the original batches ended. It's
+  always against the fake server: the recorded windows don't exist on any
+  other, so nothing would get managed.
+  */
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to open trace %s (%s)", path, strerror(errno)
+    );
+    return 1;
+  }
+  trace_header_t header;
+  if (
+    fread(&header, sizeof(header), 1, file) != 1
+    || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+    || header.version != TRACE_VERSION
+  ) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "%s isn't a version %d trace", path, TRACE_VERSION
+    );
+    fclose(file);
+    return 1;
+  }
+  /* Nothing gets launched, it all happened the first time round */
+  replaying = true;
+  init_fake_server();
+  fake_screen.width_in_pixels = header.width;
+  fake_screen.height_in_pixels = header.height;
+  if (trace_file) write_trace_header();
+  init_xkb();
+  for (int i = 0; i < NUM_KEYMAPS; i++)
+    grab_keymap(i);
+  for (int i = 0; i < NUM_WORKSPACES; i++) {
+    root_regions[i] = -1;
+    free_regions[i] = -1;
+  }
+
+  log_msg(LOG_LEVEL_INFO, "Replaying %s...", path);
+  log_level_t original_level = log_level;
+  if (log_level < LOG_LEVEL_WARNING) log_level = LOG_LEVEL_WARNING;
+  uint64_t start_time = get_time_ns();
+  uint64_t trace_time = 0;
+  int events = 0, batches = 0, recorded_requests = 0;
+  trace_record_t record;
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    trace_time = record.time;
+    if (record.kind == TRACE_EVENT) {
+      xcb_generic_event_t event;
+      memset(&event, 0, sizeof(event));
+      memcpy(&event, record.event, sizeof(record.event));
+      event.full_sequence = record.sequence;
+      /* The fake server can only tell what's a menu from the trace */
+      if (
+        (event.response_type & ~0x80) == XCB_MAP_NOTIFY
+        && ((xcb_map_notify_event_t *)&event)->override_redirect
+      )
+        fake_add_override_window(((xcb_map_notify_event_t *)&event)->window);
+      dispatch_event(&event);
+      events++;
+    } else if (record.kind == TRACE_REQUEST) {
+      recorded_requests++;
+    } else if (record.kind == TRACE_BATCH) {
+      handle_connection(-1, EPOLLIN);
+      finish_batch();
+      batches++;
+    }
+  }
+  handle_connection(-1, EPOLLIN);
+  finish_batch();
+  uint64_t replay_time = get_time_ns() - start_time;
+  log_level = original_level;
+
+  log_msg(
+      LOG_LEVEL_INFO,
+      "Replayed %d events in %d batches in %.3fms (%.3fs when recorded)",
+      events, batches, replay_time / 1e6, trace_time / 1e9
+  );
+  if (events)
+    log_msg(
+        LOG_LEVEL_INFO, "%.1fns per event",
+        (double)replay_time / events
+    );
+  log_msg(
+      LOG_LEVEL_INFO, "Sent %d requests, %d were recorded",
+      (int)requests_sent, recorded_requests
+  );
+  dump_time = start_time;
+  dump_stats();
+  fclose(file);
+  if (trace_file) {
+    trace_batch();
+    fclose(trace_file);
+  }
+  return 0;
+}
+static void init_fake_server(void) {
+  /* A single 1920x1080 screen, with nothing on it */
+  backend = &FAKE_BACKEND;
+  fake_screen.root = 1;
+  fake_screen.width_in_pixels = 1920;
+  fake_screen.height_in_pixels = 1080;
+  screen = &fake_screen;
+  root = fake_screen.root;
+  fake_sequence = 0;
+  memset(fake_request_counts, 0, sizeof(fake_request_counts));
+  first_fake_event = 0;
+  num_fake_events = 0;
+  num_fake_override_windows = 0;
+}
+static void fake_add_override_window(xcb_window_t window) {
+  /* Only recent ones matter, their attributes are asked for straight away */
+  fake_override_windows[
+    num_fake_override_windows++ % FAKE_OVERRIDE_WINDOWS
+  ] = window;
+}
+static bool fake_is_override_window(xcb_window_t window) {
+  int count = num_fake_override_windows < FAKE_OVERRIDE_WINDOWS
+    ? num_fake_override_windows : FAKE_OVERRIDE_WINDOWS;
+  for (int i = 0; i < count; i++)
+    if (fake_override_windows[i] == window)
+      return true;
+  return false;
+}
+static unsigned int fake_record(
+    request_type_t type, xcb_window_t window, uint16_t value_mask
+) {
+  fake_request_t *request = &fake_requests[++fake_sequence % FAKE_REQUEST_LOG];
+  request->sequence = fake_sequence;
+  request->type = type;
+  request->window = window;
+  request->value_mask = value_mask;
+  fake_request_counts[type]++;
+  return sent_request(type, window, value_mask, fake_sequence);
+}
+static void fake_inject_event(const void *event, size_t size) {
+  /*
+  Events are 32 bytes on the wire, xcb adds full_sequence after that.
+  Most event structs are shorter, the rest is padding and left zeroed.
+  */
+  if (num_fake_events == FAKE_EVENT_QUEUE)
+    log_msg(LOG_LEVEL_ERROR, "Fake event queue is full");
+  xcb_generic_event_t *queued = &fake_events[
+    (first_fake_event + num_fake_events++) % FAKE_EVENT_QUEUE
+  ];
+  memset(queued, 0, sizeof(*queued));
+  memcpy(queued, event, size < 32 ? size : 32);
+  queued->full_sequence = fake_sequence;
+}
+static unsigned int fake_configure_window(
+    xcb_window_t window, uint16_t value_mask, const uint32_t *value_list
+) {
+  return fake_record(REQUEST_CONFIGURE_WINDOW, window, value_mask);
+}
+static unsigned int fake_map_window(xcb_window_t window) {
+  return fake_record(REQUEST_MAP_WINDOW, window, 0);
+}
+static unsigned int fake_unmap_window(xcb_window_t window) {
+  return fake_record(REQUEST_UNMAP_WINDOW, window, 0);
+}
+static unsigned int fake_send_event(xcb_window_t window, const void *event) {
+  return fake_record(REQUEST_SEND_EVENT, window, 0);
+}
+static unsigned int fake_grab_key(
+    xcb_window_t window, uint16_t modifiers, xcb_keycode_t keycode
+) {
+  return fake_record(REQUEST_GRAB_KEY, window, modifiers);
+}
+static unsigned int fake_grab_server(void) {
+  return fake_record(REQUEST_GRAB_SERVER, root, 0);
+}
+static unsigned int fake_ungrab_server(void) {
+  return fake_record(REQUEST_UNGRAB_SERVER, root, 0);
+}
+static unsigned int fake_get_window_attributes(xcb_window_t window) {
+  return fake_record(REQUEST_GET_WINDOW_ATTRIBUTES, window, 0);
+}
+static unsigned int fake_get_input_focus(void) {
+  return fake_record(REQUEST_GET_INPUT_FOCUS, root, 0);
+}
+static unsigned int fake_change_event_mask(
+    xcb_window_t window, uint32_t event_mask
+) {
+  return fake_record(REQUEST_CHANGE_EVENT_MASK, window, 0);
+}
+static bool fake_poll_for_reply(
+    unsigned int sequence, void **reply, xcb_generic_error_t **error
+) {
+  /* Every window is viewable and managed, replies are always ready */
+  *reply = NULL;
+  *error = NULL;
+  fake_request_t *request = &fake_requests[sequence % FAKE_REQUEST_LOG];
+  if (request->sequence != sequence) return true;
+  if (request->type == REQUEST_GET_WINDOW_ATTRIBUTES) {
+    xcb_get_window_attributes_reply_t *attributes =
+      calloc(1, sizeof(xcb_get_window_attributes_reply_t));
+    if (!attributes)
+      log_msg(LOG_LEVEL_ERROR, "Failed to allocate fake reply");
+    attributes->response_type = 1;
+    attributes->sequence = sequence;
+    attributes->map_state = XCB_MAP_STATE_VIEWABLE;
+    attributes->override_redirect = fake_is_override_window(request->window);
+    *reply = attributes;
+  } else if (request->type == REQUEST_GET_INPUT_FOCUS) {
+    xcb_get_input_focus_reply_t *focus =
+      calloc(1, sizeof(xcb_get_input_focus_reply_t));
+    if (!focus)
+      log_msg(LOG_LEVEL_ERROR, "Failed to allocate fake reply");
+    focus->response_type = 1;
+    focus->sequence = sequence;
+    focus->focus = root;
+    *reply = focus;
+  }
+  return true;
+}
+static void *fake_wait_for_reply(
+    unsigned int sequence, xcb_generic_error_t **error
+) {
+  void *reply;
+  fake_poll_for_reply(sequence, &reply, error);
+  return reply;
+}
+static xcb_generic_event_t *fake_poll_for_event(void) {
+  if (!num_fake_events) return NULL;
+  xcb_generic_event_t *event = malloc(sizeof(xcb_generic_event_t));
+  if (!event)
+    log_msg(LOG_LEVEL_ERROR, "Failed to allocate fake event");
+  *event = fake_events[first_fake_event];
+  first_fake_event = (first_fake_event + 1) % FAKE_EVENT_QUEUE;
+  num_fake_events--;
+  return event;
+}
+static void fake_flush(void) { }
+static int fake_connection_error(void) {
+  return 0;
+}
+static void init_launcher(void) {
+  /*
+  Everything a launch needs is prepared once here. posix_spawn() uses
+  vfork semantics, so the page tables aren't copied, and it reports exec
+  failures back to us rather than leaving a second window manager behind.
+  */
+  devnull_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (devnull_fd < 0)
+    log_msg(
+        LOG_LEVEL_ERROR,
+        "Failed to open /dev/null (%s)", strerror(errno)
+    );
+  posix_spawn_file_actions_init(&spawn_file_actions);
+  posix_spawn_file_actions_adddup2(
+      &spawn_file_actions, devnull_fd, STDOUT_FILENO
+  );
+  posix_spawn_file_actions_adddup2(
+      &spawn_file_actions, devnull_fd, STDERR_FILENO
+  );
+  /* Signals get blocked for the event loop, children shouldn't inherit that */
+  sigset_t sigmask;
+  sigprocmask(SIG_BLOCK, NULL, &sigmask);
+  posix_spawnattr_init(&spawn_attributes);
+  posix_spawnattr_setsigmask(&spawn_attributes, &sigmask);
+  /* Nor that SIGPIPE is ignored */
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_setsigdefault(&spawn_attributes, &defaults);
+  posix_spawnattr_setflags(
+      &spawn_attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF
+  );
+}
+static void start_launcher(void) {
+  /*
+  This has to happen before connecting to the X server, or the helper
+  would hold the connection open after we exit.
+  */
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to create launcher socket (%s)", strerror(errno)
+    );
+    return;
+  }
+  launcher_pid = fork();
+  if (launcher_pid < 0) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to start launcher (%s)", strerror(errno)
+    );
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+  if (!launcher_pid) {
+    close(fds[0]);
+    if (restore_fd >= 0) close(restore_fd);
+    run_launcher(fds[1]);
+  }
+  close(fds[1]);
+  launcher_fd = fds[0];
+  log_msg(LOG_LEVEL_INFO, "Started launcher (pid %d)", (int)launcher_pid);
+}
+static void stop_launcher(void) {
+  /* The launcher quits once its end of the socket hangs up */
+  if (launcher_fd < 0) return;
+  unwatch_fd(launcher_fd);
+  close(launcher_fd);
+  launcher_fd = -1;
+  for (int i = 0; i < num_queued_launches; i++)
+    free(queued_launches[i].message);
+  free(queued_launches);
+  queued_launches = NULL;
+  num_queued_launches = queued_launches_capacity = 0;
+  /* Anything it hadn't answered for never got launched as far as we know */
+  for (int i = 0; i < num_children;) {
+    if (children[i].pid) {
+      i++;
+      continue;
+    }
+    child_stats.failed_launches++;
+    free(children[i].command);
+    children[i] = children[--num_children];
+  }
+}
+static const char *resolve_path(const char *name) {
+  /* Only used by the launcher, which keeps what it finds, NULL if not found */
+  if (strchr(name, '/')) return name;
+  for (int i = 0; i < num_resolved_paths; i++)
+    if (!strcmp(resolved_paths[i].name, name))
+      return resolved_paths[i].path;
+  if (strlen(name) >= sizeof(resolved_paths[0].name)) return NULL;
+  const char *path = getenv("PATH");
+  if (!path) path = "/usr/local/bin:/usr/bin:/bin";
+  while (*path) {
+    size_t length = strcspn(path, ":");
+    char candidate[PATH_MAX];
+    if (
+      length
+      && snprintf(
+          candidate, sizeof(candidate), "%.*s/%s", (int)length, path, name
+      ) < (int)sizeof(candidate)
+      && !access(candidate, X_OK)
+    ) {
+      /* When it's full, make room by forgetting the newest */
+      if (num_resolved_paths == MAX_RESOLVED_PATHS) num_resolved_paths--;
+      resolved_path_t *resolved = &resolved_paths[num_resolved_paths++];
+      strcpy(resolved->name, name);
+      strcpy(resolved->path, candidate);
+      return resolved->path;
+    }
+    path += length;
+    if (*path) path++;
+  }
+  return NULL;
+}
+static void forget_path(const char *name) {
+  for (int i = 0; i < num_resolved_paths; i++)
+    if (!strcmp(resolved_paths[i].name, name))
+      resolved_paths[i] = resolved_paths[--num_resolved_paths];
+}
+static int spawn_resolved(pid_t *pid, char **argv) {
+  const char *path = resolve_path(argv[0]);
+  if (!path)
+    return posix_spawnp(
+        pid, argv[0], &spawn_file_actions, &spawn_attributes, argv, environ
+    );
+  return posix_spawn(
+      pid, path, &spawn_file_actions, &spawn_attributes, argv, environ
+  );
+}
+static void run_launcher(int fd) {
+  /* Process creation happens here, the window manager only sends requests */
+  sigset_t sigmask;
+  sigemptyset(&sigmask);
+  sigaddset(&sigmask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &sigmask, NULL);
+  int child_fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (child_fd < 0) _exit(1);
+  /* Look up everything KEYMAPS can launch up front */
+  for (int i = 0; i < NUM_KEYMAPS; i++)
+    if (KEYMAPS[i].handler == handle_keymap_spawnprocess)
+      resolve_path(((char **)KEYMAPS[i].data.ptr)[0]);
+
+  struct pollfd fds[2] = {
+    { .fd = fd, .events = POLLIN },
+    { .fd = child_fd, .events = POLLIN }
+  };
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      _exit(1);
+    }
+    if (fds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(child_fd, &info, sizeof(info)) == sizeof(info));
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        launcher_reply_t reply = {
+          .type = LAUNCHER_EXITED, .pid = pid, .status = status
+        };
+        send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+      }
+    }
+    if (!fds[0].revents) continue;
+    char message[LAUNCH_MESSAGE_SIZE];
+    ssize_t size = recv(fd, message, sizeof(message) - 1, 0);
+    if (size <= 0) _exit(0);
+    if (size < (ssize_t)sizeof(launch_request_t)) continue;
+    message[size] = '\0';
+    launch_request_t request;
+    char *argv[MAX_LAUNCH_ARGS + 1];
+    decode_launch_request(message, size, &request, argv);
+    launcher_reply_t reply = { .type = LAUNCHER_LAUNCHED, .id = request.id };
+    pid_t pid;
+    int error = argv[0] ? spawn_resolved(&pid, argv) : EINVAL;
+    /* It may have moved since we looked it up */
+    if (error == ENOENT) {
+      forget_path(argv[0]);
+      error = spawn_resolved(&pid, argv);
+    }
+    if (error) {
+      reply.type = LAUNCHER_FAILED;
+      reply.status = error;
+    } else reply.pid = pid;
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+  }
+}
+static void decode_launch_request(
+    char *message, size_t size, launch_request_t *request, char **argv
+) {
+  /* The request is followed by argv, each string NUL-terminated */
+  memcpy(request, message, sizeof(*request));
+  char *arg = message + sizeof(*request);
+  uint32_t argc = 0;
+  while (
+    argc < request->argc && argc < MAX_LAUNCH_ARGS && arg < message + size
+  ) {
+    argv[argc++] = arg;
+    arg += strlen(arg) + 1;
+  }
+  argv[argc] = NULL;
+}
+static void spawn_process_quiet(char **argv) {
+  if (replaying) {
+    log_msg(LOG_LEVEL_INFO, "Not launching %s while replaying", argv[0]);
+    return;
+  }
+  int child = add_child(argv);
+  if (launcher_fd >= 0 && request_launch(child, argv)) return;
+  spawn_directly(child, argv);
+}
+static void spawn_directly(int child, char **argv) {
+  /* Only without the launcher, since it means forking all of us */
+  pid_t pid;
+  int error = posix_spawnp(
+      &pid, argv[0], &spawn_file_actions, &spawn_attributes, argv, environ
+  );
+  if (error) launch_failed(child, error);
+  /* It has already been exec'd by the time posix_spawnp() returns */
+  else launch_succeeded(child, pid);
+}
+static bool request_launch(int child, char **argv) {
+  char message[LAUNCH_MESSAGE_SIZE];
+  launch_request_t request = {
+    .id = children[child].launch_id,
+    .workspace = workspace,
+    .argc = 0
+  };
+  size_t size = sizeof(request);
+  for (; argv[request.argc]; request.argc++) {
+    size_t length = strlen(argv[request.argc]) + 1;
+    if (request.argc == MAX_LAUNCH_ARGS || size + length > sizeof(message))
+      return false;
+    memcpy(message + size, argv[request.argc], length);
+    size += length;
+  }
+  memcpy(message, &request, sizeof(request));
+  /* Behind anything already waiting, so launches keep their order */
+  if (num_queued_launches) {
+    queue_launch(message, size);
+    return true;
+  }
+  if (send(launcher_fd, message, size, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    /* It's only busy, wait for room rather than forking ourselves */
+    if (errno == EAGAIN) {
+      queue_launch(message, size);
+      watch_launcher_output(true);
+      return true;
+    }
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Lost the launcher (%s), launching directly", strerror(errno)
+    );
+    lose_launcher();
+    return false;
+  }
+  return true;
+}
+static void queue_launch(const char *message, size_t size) {
+  if (num_queued_launches == queued_launches_capacity) {
+    queued_launches_capacity =
+      queued_launches_capacity ? queued_launches_capacity * 2 : 16;
+    queued_launches = realloc(
+        queued_launches, queued_launches_capacity * sizeof(queued_launch_t)
+    );
+    if (!queued_launches)
+      log_msg(LOG_LEVEL_ERROR, "Failed to allocate launch queue");
+  }
+  queued_launch_t *queued = &queued_launches[num_queued_launches++];
+  queued->size = size;
+  queued->message = malloc(size);
+  if (!queued->message)
+    log_msg(LOG_LEVEL_ERROR, "Failed to allocate launch request");
+  memcpy(queued->message, message, size);
+}
+static bool send_queued_launches(void) {
+  /* Returns false if the launcher has gone */
+  int sent = 0;
+  bool lost = false;
+  for (; sent < num_queued_launches; sent++) {
+    queued_launch_t *queued = &queued_launches[sent];
+    if (
+      send(
+          launcher_fd, queued->message, queued->size,
+          MSG_DONTWAIT | MSG_NOSIGNAL
+      ) < 0
+    ) {
+      lost = errno != EAGAIN;
+      break;
+    }
+    free(queued->message);
+  }
+  num_queued_launches -= sent;
+  memmove(
+      queued_launches, queued_launches + sent,
+      num_queued_launches * sizeof(queued_launch_t)
+  );
+  if (!num_queued_launches) watch_launcher_output(false);
+  return !lost;
+}
+static void watch_launcher_output(bool watch) {
+  struct epoll_event event = {
+    .events = EPOLLIN | (watch ? EPOLLOUT : 0),
+    .data.fd = launcher_fd
+  };
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, launcher_fd, &event);
+}
+static void lose_launcher(void) {
+  /* What it never got is launched directly, in the order it was asked for */
+  for (int i = 0; i < num_queued_launches; i++) {
+    launch_request_t request;
+    char *argv[MAX_LAUNCH_ARGS + 1];
+    decode_launch_request(
+        queued_launches[i].message, queued_launches[i].size, &request, argv
+    );
+    for (int child = 0; child < num_children; child++)
+      if (children[child].launch_id == request.id && !children[child].pid) {
+        spawn_directly(child, argv);
+        break;
+      }
+  }
+  stop_launcher();
+}
+static void handle_launcher(int fd, uint32_t events) {
+  launcher_reply_t reply;
+  ssize_t size;
+  while (
+    (size = recv(fd, &reply, sizeof(reply), MSG_DONTWAIT)) == sizeof(reply)
+  ) {
+    int child = -1;
+    for (int i = 0; i < num_children; i++)
+      if (
+        reply.type == LAUNCHER_EXITED
+        ? children[i].pid == reply.pid
+        : children[i].launch_id == reply.id && !children[i].pid
+      )
+        child = i;
+    if (reply.type == LAUNCHER_EXITED)
+      child_exited(child, reply.pid, reply.status);
+    else if (child < 0)
+      continue;
+    else if (reply.type == LAUNCHER_LAUNCHED)
+      launch_succeeded(child, reply.pid);
+    else
+      launch_failed(child, reply.status);
+  }
+  bool lost = !size || (size < 0 && errno != EAGAIN) || (events & EPOLLHUP);
+  if (!lost && (events & EPOLLOUT)) lost = !send_queued_launches();
+  if (lost) {
+    log_msg(LOG_LEVEL_WARNING, "Launcher quit, launching directly");
+    lose_launcher();
+  }
+}
+static int add_child(char **argv) {
+  if (num_children == children_capacity) {
+    children_capacity = children_capacity ? children_capacity * 2 : 16;
+    children = realloc(children, children_capacity * sizeof(child_t));
+    if (!children)
+      log_msg(LOG_LEVEL_ERROR, "Failed to allocate child table");
+  }
+  size_t length = 0;
+  for (int i = 0; argv[i]; i++)
+    length += strlen(argv[i]) + 1;
+  char *command = malloc(length ? length : 1);
+  if (!command)
+    log_msg(LOG_LEVEL_ERROR, "Failed to allocate child command");
+  command[0] = '\0';
+  for (int i = 0; argv[i]; i++) {
+    if (i) strcat(command, " ");
+    strcat(command, argv[i]);
+  }
+  children[num_children].pid = 0;
+  children[num_children].launch_id = ++last_launch_id;
+  children[num_children].command = command;
+  children[num_children].workspace = workspace;
+  children[num_children].launch_time = dispatch_time;
+  return num_children++;
+}
+static void launch_succeeded(int child, pid_t pid) {
+  uint64_t launch_time = get_time_ns() - children[child].launch_time;
+  children[child].pid = pid;
+  child_stats.launched++;
+  child_stats.launch_time_total += launch_time;
+  if (launch_time > child_stats.launch_time_max)
+    child_stats.launch_time_max = launch_time;
+  log_msg(
+      LOG_LEVEL_INFO,
+      "Launched %s (pid %d) on workspace %d in %.3fms",
+      children[child].command, (int)pid, children[child].workspace,
+      launch_time / 1e6
+  );
+}
+static void launch_failed(int child, int error) {
+  child_stats.failed_launches++;
+  log_msg(
+      LOG_LEVEL_WARNING,
+      "Failed to launch %s (%s)", children[child].command, strerror(error)
+  );
+  free(children[child].command);
+  children[child] = children[--num_children];
+}
+static void child_exited(int child, pid_t pid, int status) {
+  /* Like the launcher we had before restarting, which is still our child */
+  if (child < 0) return;
+  if (WIFSIGNALED(status)) child_stats.killed++;
+  else if (WEXITSTATUS(status)) child_stats.failed++;
+  else child_stats.exited++;
+  log_msg(
+      LOG_LEVEL_INFO,
+      "%s (pid %d, workspace %d) %s %d after %.3fs",
+      children[child].command, (int)pid, children[child].workspace,
+      WIFSIGNALED(status) ? "was killed by signal" : "exited with status",
+      WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status),
+      (get_time_ns() - children[child].launch_time) / 1e9
+  );
+  free(children[child].command);
+  children[child] = children[--num_children];
+}
+static void reap_children(void) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (pid == launcher_pid) {
+      launcher_pid = -1;
+      continue;
+    }
+    int child = -1;
+    for (int i = 0; i < num_children; i++)
+      if (children[i].pid == pid)
+        child = i;
+    child_exited(child, pid, status);
+  }
+}
+static void dump_stats(void) {
+  /* Asked for explicitly, so shown whatever the log level */
+  log_level_t original_level = log_level;
+  log_level = LOG_LEVEL_INFO;
+  uint64_t now = get_time_ns();
+  double elapsed = (now - dump_time) / 1e9;
+  log_msg(
+      LOG_LEVEL_INFO,
+      "Since the last dump (%.3fs): %.1f requests per second",
+      elapsed, (requests_sent - dumped_requests) / elapsed
+  );
+  log_msg(
+      LOG_LEVEL_INFO,
+      "Loop: %llu batches, %llu relayouts (%llu regions), "
+      "%llu requests, %llu replies awaited, %llu blocking waits",
+      (unsigned long long)loop_stats.batches,
+      (unsigned long long)loop_stats.relayouts,
+      (unsigned long long)loop_stats.regions_laid_out,
+      (unsigned long long)requests_sent,
+      (unsigned long long)loop_stats.replies_awaited,
+      (unsigned long long)loop_stats.blocking_waits
+  );
+  for (int i = 0; i < NUM_EVENT_TYPES; i++) {
+    if (!event_counts[i]) continue;
+    char name[32];
+    if (i < (int)(sizeof(EVENT_NAMES)/sizeof(EVENT_NAMES[0])) && EVENT_NAMES[i])
+      snprintf(name, sizeof(name), "%s", EVENT_NAMES[i]);
+    else
+      snprintf(name, sizeof(name), "event %d", i);
+    log_histogram(
+        name, &event_latencies[i],
+        (event_counts[i] - dumped_event_counts[i]) / elapsed
+    );
+    dumped_event_counts[i] = event_counts[i];
+  }
+  for (int i = 0; i < NUM_KEYMAPS; i++) {
+    if (!keymap_latencies[i].count) continue;
+    char name[64] = "key ";
+    if (xkb_keysym_get_name(KEYMAPS[i].keysym, name + 4, sizeof(name) - 4) < 0)
+      strcpy(name + 4, "???");
+    log_histogram(name, &keymap_latencies[i], -1);
+  }
+  for (int i = 0; i < NUM_IPC_COMMANDS; i++) {
+    if (!ipc_latencies[i].count) continue;
+    char name[64];
+    snprintf(name, sizeof(name), "command %s", IPC_COMMANDS[i].name);
+    log_histogram(name, &ipc_latencies[i], -1);
+  }
+  dump_time = now;
+  dumped_requests = requests_sent;
+  log_msg(
+      LOG_LEVEL_INFO,
+      "Children: %d launched, %d failed to launch, %d running, "
+      "%d exited, %d failed, %d killed",
+      child_stats.launched, child_stats.failed_launches, num_children,
+      child_stats.exited, child_stats.failed, child_stats.killed
+  );
+  if (child_stats.launched)
+    log_msg(
+        LOG_LEVEL_INFO,
+        "Launch time: %.3fms average, %.3fms max",
+        child_stats.launch_time_total / 1e6 / child_stats.launched,
+        child_stats.launch_time_max / 1e6
+    );
+  for (int i = 0; i < num_children; i++)
+    log_msg(
+        LOG_LEVEL_INFO,
+        "Child %d: %s (workspace %d, running for %.3fs)",
+        (int)children[i].pid, children[i].command, children[i].workspace,
+        (get_time_ns() - children[i].launch_time) / 1e9
+    );
+  log_level = original_level;
+}
+static int histogram_bucket(uint64_t value) {
+  /* Exact below 4ns, then four buckets to each power of two */
+  if (value < HISTOGRAM_SUB_BUCKETS) return value;
+  int exponent = 63 - __builtin_clzll(value);
+  int bucket = HISTOGRAM_SUB_BUCKETS
+    + (exponent - 2) * HISTOGRAM_SUB_BUCKETS
+    + (int)(value >> (exponent - 2)) - HISTOGRAM_SUB_BUCKETS;
+  return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+static uint64_t histogram_bucket_limit(int bucket) {
+  /* The largest value that lands in bucket */
+  if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+  int exponent = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS + 2;
+  uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+  return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (exponent - 2)) - 1;
+}
+static void record_latency(histogram_t *histogram, uint64_t latency) {
+  histogram->counts[histogram_bucket(latency)]++;
+  histogram->count++;
+  histogram->total += latency;
+  if (latency > histogram->max) histogram->max = latency;
+}
+static uint64_t histogram_percentile(
+    const histogram_t *histogram, double percentile
+) {
+  /* Errs high, by at most a bucket */
+  uint64_t target = histogram->count * percentile;
+  if (target < 1) target = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= target) {
+      uint64_t limit = histogram_bucket_limit(i);
+      return limit < histogram->max ? limit : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+static void log_histogram(
+    const char *name, const histogram_t *histogram, double rate
+) {
+  /* Rate is per second, negative if it doesn't apply */
+  char rate_text[32] = "";
+  if (rate >= 0) snprintf(rate_text, sizeof(rate_text), ", %.1f/s", rate);
+  log_msg(
+      LOG_LEVEL_INFO,
+      "%-25s %8llu, mean %.1fus, p50 %.1fus, p99 %.1fus, max %.1fus%s",
+      name, (unsigned long long)histogram->count,
+      histogram->total / 1e3 / histogram->count,
+      histogram_percentile(histogram, 0.5) / 1e3,
+      histogram_percentile(histogram, 0.99) / 1e3,
+      histogram->max / 1e3, rate_text
+  );
+}
+static void cleanup(void) {
+  stop_ipc();
+  if (state) munmap(state, state_size);
+  if (state_fd >= 0) close(state_fd);
+  if (trace_file) {
+    trace_batch();
+    fclose(trace_file);
+  }
+  stop_launcher();
+  posix_spawnattr_destroy(&spawn_attributes);
+  posix_spawn_file_actions_destroy(&spawn_file_actions);
+  close(devnull_fd);
+  close(timer_fd);
+  close(signal_fd);
+  close(epoll_fd);
+  free(keysym_index);
+  free(window_index);
+  for (int i = 0; i < num_children; i++)
+    free(children[i].command);
+  free(children);
+  for (int i = 0; i < NUM_WORKSPACES; i++)
+    free(regions[i]);
+  xkb_state_unref(xkb_state);
+  xkb_keymap_unref(xkb_keymap);
+  xkb_context_unref(xkb_context);
+  xcb_disconnect(connection);
+  flush_log(true);
+}
+static void init_ipc(void) {
+  /*
+  Commands come in over a Unix socket, one per line or several separated
+  by ';'. A message is handled in one go, so however many commands it
+  holds, they cost a single layout pass and flush.
+  */
+  for (int i = 0; i < MAX_IPC_CLIENTS; i++)
+    ipc_clients[i].fd = -1;
+  const char *path = getenv("WM_SOCKET");
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  const char *display = getenv("DISPLAY");
+  int length = path
+    ? snprintf(ipc_path, sizeof(ipc_path), "%s", path)
+    : snprintf(
+        ipc_path, sizeof(ipc_path), "%s/wm-%s.sock",
+        runtime_dir ? runtime_dir : "/tmp", display ? display : ":0"
+    );
+  if (length >= (int)sizeof(ipc_path)) {
+    log_msg(LOG_LEVEL_WARNING, "Control socket path is too long");
+    ipc_path[0] = '\0';
+    return;
+  }
+  ipc_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (ipc_fd < 0) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to create control socket (%s)", strerror(errno)
+    );
+    ipc_path[0] = '\0';
+    return;
+  }
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  memcpy(address.sun_path, ipc_path, length + 1);
+  /* Anyone who can connect can run anything, so it's only for us */
+  mode_t original_umask = umask(0077);
+  int result = bind(ipc_fd, (struct sockaddr *)&address, sizeof(address));
+  if (result < 0 && errno == EADDRINUSE) {
+    /* Left behind by a crash, unless something still answers on it */
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (
+      probe >= 0
+      && connect(probe, (struct sockaddr *)&address, sizeof(address)) < 0
+      && errno == ECONNREFUSED
+    ) {
+      unlink(ipc_path);
+      result = bind(ipc_fd, (struct sockaddr *)&address, sizeof(address));
+    } else errno = EADDRINUSE;
+    if (probe >= 0) close(probe);
+  }
+  umask(original_umask);
+  if (result < 0 || listen(ipc_fd, MAX_IPC_CLIENTS) < 0) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to listen on %s (%s)", ipc_path, strerror(errno)
+    );
+    close(ipc_fd);
+    ipc_fd = -1;
+    ipc_path[0] = '\0';
+    return;
+  }
+  watch_fd(ipc_fd, EPOLLIN, handle_ipc_listener);
+  log_msg(LOG_LEVEL_INFO, "Listening for commands on %s", ipc_path);
+}
+static void stop_ipc(void) {
+  for (int i = 0; i < MAX_IPC_CLIENTS; i++)
+    if (ipc_clients[i].fd >= 0)
+      close_ipc_client(&ipc_clients[i]);
+  if (ipc_fd < 0) return;
+  unwatch_fd(ipc_fd);
+  close(ipc_fd);
+  ipc_fd = -1;
+  unlink(ipc_path);
+}
+static void handle_ipc_listener(int fd, uint32_t events) {
+  int client_fd;
+  while (
+    (client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0
+  ) {
+    /* In case the socket's directory let someone else in anyway */
+    struct ucred credentials;
+    socklen_t credentials_size = sizeof(credentials);
+    if (
+      getsockopt(
+          client_fd, SOL_SOCKET, SO_PEERCRED,
+          &credentials, &credentials_size
+      ) < 0
+      || credentials.uid != getuid()
+    ) {
+      log_msg(
+          LOG_LEVEL_WARNING, "Refused a control connection from another user"
+      );
+      close(client_fd);
+      continue;
+    }
+    ipc_client_t *client = NULL;
+    for (int i = 0; i < MAX_IPC_CLIENTS && !client; i++)
+      if (ipc_clients[i].fd < 0)
+        client = &ipc_clients[i];
+    if (!client) {
+      log_msg(LOG_LEVEL_WARNING, "Too many control connections");
+      close(client_fd);
+      continue;
+    }
+    client->fd = client_fd;
+    client->length = 0;
+    client->topics = 0;
+    client->queued = 0;
+    client->blocked = false;
+    client->reply_fd = -1;
+    watch_fd(client_fd, EPOLLIN, handle_ipc_client);
+  }
+}
+static void handle_ipc_client(int fd, uint32_t events) {
+  ipc_client_t *client = NULL;
+  for (int i = 0; i < MAX_IPC_CLIENTS && !client; i++)
+    if (ipc_clients[i].fd == fd)
+      client = &ipc_clients[i];
+  if (!client) return;
+  if (events & EPOLLOUT) {
+    flush_ipc_client(client);
+    if (client->fd < 0) return;
+  }
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+  for (;;) {
+    ssize_t size = recv(
+        fd, client->buffer + client->length,
+        sizeof(client->buffer) - client->length - 1, 0
+    );
+    if (size < 0 && errno == EINTR) continue;
+    if (size < 0 && errno == EAGAIN) return;
+    if (size <= 0) {
+      /* Whatever was left without a newline is the last line */
+      if (!size && client->length) {
+        client->buffer[client->length] = '\0';
+        run_ipc_line(client, client->buffer);
+      }
+      close_ipc_client(client);
+      return;
+    }
+    client->length += size;
+    client->buffer[client->length] = '\0';
+    char *line = client->buffer, *end;
+    while (client->fd >= 0 && (end = strchr(line, '\n'))) {
+      *end = '\0';
+      run_ipc_line(client, line);
+      line = end + 1;
+    }
+    if (client->fd < 0) return;
+    client->length -= line - client->buffer;
+    memmove(client->buffer, line, client->length);
+    if (client->length == sizeof(client->buffer) - 1) {
+      log_msg(LOG_LEVEL_WARNING, "Control command is too long");
+      close_ipc_client(client);
+      return;
+    }
+  }
+}
+static void close_ipc_client(ipc_client_t *client) {
+  unwatch_fd(client->fd);
+  close(client->fd);
+  client->fd = -1;
+  if (client->topics) update_ipc_topics();
+}
+static void run_ipc_line(ipc_client_t *client, char *line) {
+  /* Stops at the first command that fails, and says which */
+  dispatch_time = get_time_ns();
+  bool subscribed = client->topics;
+  char reply[256] = "ok\n";
+  int index = 0;
+  char *save;
+  for (
+    char *command = strtok_r(line, ";", &save);
+    command && client->fd >= 0;
+    command = strtok_r(NULL, ";", &save), index++
+  ) {
+    char error[192];
+    if (run_ipc_command(client, command, error, sizeof(error))) continue;
+    snprintf(reply, sizeof(reply), "error: command %d: %s\n", index, error);
+    break;
+  }
+  int reply_fd = client->reply_fd;
+  client->reply_fd = -1;
+  if (subscribed || client->fd < 0) {
+    if (reply_fd >= 0) close(reply_fd);
+    return;
+  }
+  struct iovec part = { .iov_base = reply, .iov_len = strlen(reply) };
+  struct msghdr message = { .msg_iov = &part, .msg_iovlen = 1 };
+  char control[CMSG_SPACE(sizeof(int))];
+  if (reply_fd >= 0 && !strcmp(reply, "ok\n")) {
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &reply_fd, sizeof(int));
+  }
+  /* A client that won't read its replies isn't worth waiting for */
+  if (sendmsg(client->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    close_ipc_client(client);
+  if (reply_fd >= 0) close(reply_fd);
+}
+static bool run_ipc_command(
+    ipc_client_t *client, char *command, char *error, size_t error_size
+) {
+  char *words[MAX_LAUNCH_ARGS + 2];
+  int num_words = 0;
+  char *save;
+  for (
+    char *word = strtok_r(command, " \t\r", &save);
+    word && num_words <= MAX_LAUNCH_ARGS;
+    word = strtok_r(NULL, " \t\r", &save)
+  )
+    words[num_words++] = word;
+  words[num_words] = NULL;
+  /* So "a;;b" is fine */
+  if (!num_words) return true;
+  if (!strcmp(words[0], "state")) {
+    /* Reopened read-only, so observers can't write to it */
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", state_fd);
+    int fd = state_fd >= 0 ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (num_words != 1 || fd < 0) {
+      if (fd >= 0) close(fd);
+      snprintf(
+          error, error_size, num_words != 1 ? "usage: state" : "no state"
+      );
+      return false;
+    }
+    if (client->reply_fd >= 0) close(client->reply_fd);
+    client->reply_fd = fd;
+    return true;
+  }
+  if (!strcmp(words[0], "subscribe")) {
+    if (subscribe_ipc_client(client, words + 1, num_words - 1)) return true;
+    snprintf(
+        error, error_size,
+        "usage: subscribe [workspace|window|focus|layout]..."
+    );
+    return false;
+  }
+  const ipc_command_t *ipc_command = NULL;
+  for (int i = 0; i < NUM_IPC_COMMANDS && !ipc_command; i++)
+    if (!strcmp(IPC_COMMANDS[i].name, words[0]))
+      ipc_command = &IPC_COMMANDS[i];
+  if (!ipc_command) {
+    snprintf(error, error_size, "unknown command %s", words[0]);
+    return false;
+  }
+
+  /* Handlers get what a key press over the window would have given them */
+  xcb_key_press_event_t event = {
+    .response_type = XCB_KEY_PRESS,
+    .time = XCB_CURRENT_TIME,
+    .root = root,
+    .event = root
+  };
+  keymap_data_t data = { .i32 = 0 };
+  bool valid = false;
+  switch (ipc_command->args) {
+    case IPC_ARGS_NONE:
+      valid = num_words == 1;
+      break;
+    case IPC_ARGS_WORKSPACE:
+      valid = num_words == 2 && parse_ipc_workspace(words[1], &data.i32);
+      break;
+    case IPC_ARGS_WINDOW:
+      valid = num_words == 2 && parse_ipc_window(words[1], &event.child);
+      break;
+    case IPC_ARGS_WINDOW_WORKSPACE:
+      valid = num_words == 3
+        && parse_ipc_window(words[1], &event.child)
+        && parse_ipc_workspace(words[2], &data.i32);
+      break;
+    case IPC_ARGS_WINDOW_FACTOR: {
+      char *end;
+      valid = num_words == 3 && parse_ipc_window(words[1], &event.child);
+      if (valid) data.f32 = strtof(words[2], &end);
+      /* Also keeps out NaN, which would get past the handler's clamping */
+      valid = valid && !*end && data.f32 > -1.0f && data.f32 < 1.0f;
+      break;
+    }
+    case IPC_ARGS_COMMAND:
+      valid = num_words >= 2 && num_words <= MAX_LAUNCH_ARGS;
+      data.ptr = words + 1;
+      break;
+  }
+  if (!valid) {
+    snprintf(error, error_size, "usage: %s", ipc_command->usage);
+    return false;
+  }
+  /* Close works on any window, the rest only on ones we manage */
+  if (
+    event.child && ipc_command->handler != handle_keymap_close
+    && !find_window(event.child)
+  ) {
+    snprintf(error, error_size, "window %s isn't managed", words[1]);
+    return false;
+  }
+  uint64_t start_time = get_time_ns();
+  ipc_command->handler(&event, data);
+  record_latency(
+      &ipc_latencies[ipc_command - IPC_COMMANDS], get_time_ns() - start_time
+  );
+  return true;
+}
+static bool subscribe_ipc_client(
+    ipc_client_t *client, char **topics, int num_topics
+) {
+  /* With no topics, it gets everything */
+  int subscribed = num_topics ? 0 : ~0;
+  for (int i = 0; i < num_topics; i++) {
+    if (!strcmp(topics[i], "workspace")) subscribed |= IPC_TOPIC_WORKSPACE;
+    else if (!strcmp(topics[i], "window")) subscribed |= IPC_TOPIC_WINDOW;
+    else if (!strcmp(topics[i], "focus")) subscribed |= IPC_TOPIC_FOCUS;
+    else if (!strcmp(topics[i], "layout")) subscribed |= IPC_TOPIC_LAYOUT;
+    else return false;
+  }
+  int topics_before = client->topics;
+  client->topics |= subscribed;
+  update_ipc_topics();
+  /* Start it off with how things are now, so it never has to ask */
+  int new_topics = client->topics & ~topics_before;
+  ipc_event_t event = { .length = sizeof(event) };
+  if (new_topics & IPC_TOPIC_WORKSPACE) {
+    event.type = IPC_EVENT_WORKSPACE;
+    event.workspace = workspace;
+    event.window = workspace;
+    queue_ipc_message(client, &event, sizeof(event));
+  }
+  if (new_topics & IPC_TOPIC_WINDOW) {
+    event.type = IPC_EVENT_WINDOW_MANAGED;
+    for (int i = 0; i < window_index_capacity && client->fd >= 0; i++) {
+      if (!window_index[i].window) continue;
+      event.workspace = window_index[i].workspace;
+      event.window = window_index[i].window;
+      queue_ipc_message(client, &event, sizeof(event));
+    }
+  }
+  if (new_topics & IPC_TOPIC_FOCUS && focused_window) {
+    event.type = IPC_EVENT_FOCUS;
+    event.workspace = workspace;
+    event.window = focused_window;
+    queue_ipc_message(client, &event, sizeof(event));
+  }
+  if (new_topics & IPC_TOPIC_LAYOUT) layout_changed = true;
+  return true;
+}
+static void update_ipc_topics(void) {
+  ipc_topics = 0;
+  for (int i = 0; i < MAX_IPC_CLIENTS; i++)
+    if (ipc_clients[i].fd >= 0)
+      ipc_topics |= ipc_clients[i].topics;
+}
+static void publish_ipc_event(
+    ipc_event_type_t type, uint32_t ws, uint32_t window
+) {
+  const int TOPICS[] = {
+    [IPC_EVENT_WORKSPACE] = IPC_TOPIC_WORKSPACE,
+    [IPC_EVENT_WINDOW_MANAGED] = IPC_TOPIC_WINDOW,
+    [IPC_EVENT_WINDOW_UNMANAGED] = IPC_TOPIC_WINDOW,
+    [IPC_EVENT_FOCUS] = IPC_TOPIC_FOCUS,
+    [IPC_EVENT_LAYOUT] = IPC_TOPIC_LAYOUT
+  };
+  if (!(ipc_topics & TOPICS[type])) return;
+  ipc_event_t event = {
+    .length = sizeof(event),
+    .type = type,
+    .workspace = ws,
+    .window = window
+  };
+  for (int i = 0; i < MAX_IPC_CLIENTS; i++)
+    if (ipc_clients[i].fd >= 0 && ipc_clients[i].topics & TOPICS[type])
+      queue_ipc_message(&ipc_clients[i], &event, sizeof(event));
+}
+static void publish_layout(void) {
+  /* Sent once per frame at most, with every window's rect */
+  if (!layout_changed) return;
+  layout_changed = false;
+  layout_time = get_time_ns();
+  if (!(ipc_topics & IPC_TOPIC_LAYOUT)) return;
+  static char message[UINT16_MAX];
+  ipc_event_t event = {
+    .length = sizeof(event),
+    .type = IPC_EVENT_LAYOUT,
+    .workspace = workspace
+  };
+  for (int i = 0; i < region_capacity[workspace]; i++) {
+    const region_t *region = &regions[workspace][i];
+    if (!region->exists || !region->handle) continue;
+    if (event.length + sizeof(ipc_layout_entry_t) > sizeof(message)) break;
+    ipc_layout_entry_t entry = {
+      .window = region->handle,
+      .x = region->x,
+      .y = region->y,
+      .width = region->width,
+      .height = region->height
+    };
+    memcpy(message + event.length, &entry, sizeof(entry));
+    event.length += sizeof(entry);
+  }
+  memcpy(message, &event, sizeof(event));
+  for (int i = 0; i < MAX_IPC_CLIENTS; i++)
+    if (ipc_clients[i].fd >= 0 && ipc_clients[i].topics & IPC_TOPIC_LAYOUT)
+      queue_ipc_message(&ipc_clients[i], message, event.length);
+}
+static void queue_ipc_message(
+    ipc_client_t *client, const void *message, size_t size
+) {
+  /* A subscriber that falls this far behind isn't worth waiting for */
+  if (client->queued + size > sizeof(client->queue)) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Dropping subscriber %d, it isn't keeping up", client->fd
+    );
+    close_ipc_client(client);
+    return;
+  }
+  memcpy(client->queue + client->queued, message, size);
+  client->queued += size;
+}
+static void flush_ipc_client(ipc_client_t *client) {
+  size_t sent = 0;
+  while (sent < client->queued) {
+    ssize_t size = send(
+        client->fd, client->queue + sent, client->queued - sent,
+        MSG_DONTWAIT | MSG_NOSIGNAL
+    );
+    if (size < 0 && errno == EINTR) continue;
+    if (size < 0 && errno == EAGAIN) break;
+    if (size < 0) {
+      close_ipc_client(client);
+      return;
+    }
+    sent += size;
+  }
+  client->queued -= sent;
+  memmove(client->queue, client->queue + sent, client->queued);
+  /* The rest goes once it's writable, without holding up the loop */
+  if (client->blocked != (client->queued > 0))
+    watch_ipc_output(client, client->queued);
+}
+static void flush_ipc_clients(void) {
+  /* Nothing can show more than a layout a frame, so coalesce the rest */
+  if (layout_changed) {
+    uint64_t now = get_time_ns();
+    uint64_t next_time = layout_time + (uint64_t)(FRAME_TIME * 1e6);
+    if (now >= next_time) publish_layout();
+    else defer(next_time - now, publish_layout);
+  }
+  for (int i = 0; i < MAX_IPC_CLIENTS; i++)
+    if (ipc_clients[i].fd >= 0 && ipc_clients[i].queued)
+      flush_ipc_client(&ipc_clients[i]);
+}
+static void watch_ipc_output(ipc_client_t *client, bool watch) {
+  client->blocked = watch;
+  struct epoll_event event = {
+    .events = EPOLLIN | (watch ? EPOLLOUT : 0),
+    .data.fd = client->fd
+  };
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
+static void init_state(void) {
+  state_fd = memfd_create("wm-state", MFD_CLOEXEC);
+  if (state_fd < 0) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to create state snapshot (%s)", strerror(errno)
+    );
+    return;
+  }
+  publish_state();
+}
+static bool grow_state(size_t size) {
+  /* Never shrinks, so a reader's mapping is never cut short */
+  if (size <= state_size) return true;
+  size_t new_size = state_size ? state_size : 4096;
+  while (new_size < size) new_size *= 2;
+  if (ftruncate(state_fd, new_size) < 0) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to grow state snapshot (%s)", strerror(errno)
+    );
+    return false;
+  }
+  state_header_t *mapped = mmap(
+      NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0
+  );
+  if (mapped == MAP_FAILED) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to map state snapshot (%s)", strerror(errno)
+    );
+    return false;
+  }
+  if (state) munmap(state, state_size);
+  state = mapped;
+  state_size = new_size;
+  return true;
+}
+static void publish_state(void) {
+  state_changed = false;
+  size_t num_regions = 0;
+  for (int i = 0; i < NUM_WORKSPACES; i++)
+    num_regions += region_capacity[i];
+  size_t size = sizeof(state_header_t)
+    + NUM_WORKSPACES * sizeof(state_workspace_t)
+    + num_regions * sizeof(state_region_t);
+  if (!grow_state(size)) return;
+  state_workspace_t *workspaces = (state_workspace_t *)(state + 1);
+  state_region_t *state_regions =
+    (state_region_t *)(workspaces + NUM_WORKSPACES);
+
+  /* Odd until it's all written, so readers know to try again */
+  __atomic_store_n(&state->generation, ++state_generation, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  state->magic = STATE_MAGIC;
+  state->version = STATE_VERSION;
+  state->size = state_size;
+  state->region_size = sizeof(state_region_t);
+  state->workspace = workspace;
+  state->focused_window = focused_window;
+  state->width = screen->width_in_pixels;
+  state->height = screen->height_in_pixels;
+  state->num_workspaces = NUM_WORKSPACES;
+  uint32_t first_region = 0;
+  for (int ws = 0; ws < NUM_WORKSPACES; ws++) {
+    workspaces[ws].root = root_regions[ws];
+    workspaces[ws].first_region = first_region;
+    workspaces[ws].num_regions = region_capacity[ws];
+    for (int i = 0; i < region_capacity[ws]; i++) {
+      const region_t *region = &regions[ws][i];
+      state_region_t *state_region = &state_regions[first_region + i];
+      state_region->exists = region->exists;
+      if (!region->exists) continue;
+      state_region->window = region->handle;
+      state_region->parent = region->parent;
+      state_region->child0 = region->child0;
+      state_region->child1 = region->child1;
+      state_region->split = region->split;
+      state_region->x = region->x;
+      state_region->y = region->y;
+      state_region->width = region->width;
+      state_region->height = region->height;
+      state_region->factor = region->factor;
+      /* A window can be somewhere other than its region, if it asked to be */
+      window_entry_t *entry = find_window(region->handle);
+      state_region->configured = entry && entry->configured;
+      if (state_region->configured) {
+        state_region->x = entry->x;
+        state_region->y = entry->y;
+        state_region->width = entry->width;
+        state_region->height = entry->height;
+      }
+    }
+    first_region += region_capacity[ws];
+  }
+  __atomic_store_n(&state->generation, ++state_generation, __ATOMIC_RELEASE);
+}
+static void restore_state(int fd) {
+  /*
+  Rebuild the region trees from the snapshot a previous instance passed
+  to us when it restarted. Windows keep the geometry they were given, so
+  the first layout pass only configures ones whose rect really changes,
+  and everything else is left exactly as it is on screen.
+  */
+  uint64_t start_time = get_time_ns();
+  struct stat info;
+  state_header_t *old = MAP_FAILED;
+  if (!fstat(fd, &info) && (size_t)info.st_size >= sizeof(state_header_t))
+    old = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (old == MAP_FAILED) {
+    log_msg(LOG_LEVEL_WARNING, "Failed to map state to restore");
+    return;
+  }
+  size_t size = sizeof(state_header_t)
+    + NUM_WORKSPACES * sizeof(state_workspace_t);
+  const state_workspace_t *old_workspaces =
+    (const state_workspace_t *)(old + 1);
+  bool valid = old->magic == STATE_MAGIC
+    && old->version == STATE_VERSION
+    && old->region_size == sizeof(state_region_t)
+    && old->num_workspaces == NUM_WORKSPACES
+    && old->workspace < NUM_WORKSPACES
+    && size <= (size_t)info.st_size
+    && !(old->generation & 1);
+  uint32_t first_region = 0;
+  for (int ws = 0; valid && ws < NUM_WORKSPACES; ws++) {
+    size += old_workspaces[ws].num_regions * sizeof(state_region_t);
+    valid = size <= (size_t)info.st_size
+      && old_workspaces[ws].first_region == first_region;
+    first_region += old_workspaces[ws].num_regions;
+  }
+  const state_region_t *old_regions =
+    (const state_region_t *)(old_workspaces + NUM_WORKSPACES);
+  /* Every link has to stay inside its own workspace's regions */
+  for (int ws = 0; valid && ws < NUM_WORKSPACES; ws++) {
+    int32_t capacity = old_workspaces[ws].num_regions;
+    const state_region_t *first =
+      &old_regions[old_workspaces[ws].first_region];
+    int32_t old_root = old_workspaces[ws].root;
+    valid = old_root == -1
+      || (old_root >= 0 && old_root < capacity && first[old_root].exists);
+    for (int32_t i = 0; valid && i < capacity; i++) {
+      if (!first[i].exists) continue;
+      valid = first[i].parent >= -1 && first[i].parent < capacity
+        && first[i].child0 >= -1 && first[i].child0 < capacity
+        && first[i].child1 >= -1 && first[i].child1 < capacity;
+    }
+  }
+  if (!valid) {
+    log_msg(LOG_LEVEL_WARNING, "State to restore is invalid, ignoring it");
+    map_snapshot_windows(old, info.st_size);
+    munmap(old, info.st_size);
+    return;
+  }
+
+  for (int ws = 0; ws < NUM_WORKSPACES; ws++) {
+    int capacity = old_workspaces[ws].num_regions;
+    if (!capacity) continue;
+    regions[ws] = malloc(capacity * sizeof(region_t));
+    if (!regions[ws])
+      log_msg(LOG_LEVEL_ERROR, "Failed to allocate regions");
+    region_capacity[ws] = capacity;
+    root_regions[ws] = old_workspaces[ws].root;
+    /* Backwards, so the free list hands out low indices first */
+    for (int i = capacity - 1; i >= 0; i--) {
+      const state_region_t *old_region =
+        &old_regions[old_workspaces[ws].first_region + i];
+      region_t *region = &regions[ws][i];
+      region->exists = old_region->exists;
+      if (!region->exists) {
+        region->handle = 0;
+        region->parent = free_regions[ws];
+        free_regions[ws] = i;
+        continue;
+      }
+      region->handle = old_region->window;
+      region->parent = old_region->parent;
+      region->child0 = old_region->child0;
+      region->child1 = old_region->child1;
+      region->split = old_region->split;
+      region->factor = old_region->factor;
+      region->x = old_region->x;
+      region->y = old_region->y;
+      region->width = old_region->width;
+      region->height = old_region->height;
+      /* Hidden workspaces may not have been laid out since they changed */
+      region->dirty = true;
+      if (!region->handle) continue;
+      index_window(region->handle, ws, i);
+      window_entry_t *entry = find_window(region->handle);
+      entry->configured = old_region->configured;
+      entry->x = old_region->x;
+      entry->y = old_region->y;
+      entry->width = old_region->width;
+      entry->height = old_region->height;
+    }
+  }
+  workspace = old->workspace;
+  if (find_window(old->focused_window))
+    focused_window = old->focused_window;
+
+  /*
+  Only now that every tree is whole, since a full pipeline waits on the
+  oldest reply, and that can remove a window. Go by the snapshot, which
+  doesn't change when that happens.
+  */
+  for (int ws = 0; ws < NUM_WORKSPACES; ws++) {
+    for (uint32_t i = 0; i < old_workspaces[ws].num_regions; i++) {
+      const state_region_t *old_region =
+        &old_regions[old_workspaces[ws].first_region + i];
+      if (!old_region->exists || !old_region->window) continue;
+      /* Anything destroyed while we were restarting has to go */
+      await_reply(
+          backend->get_window_attributes(old_region->window),
+          check_restored_window, old_region->window, 0
+      );
+      /* Event selections belong to a connection, so the old ones are gone */
+      track_request(
+          backend->change_event_mask(
+              old_region->window, XCB_EVENT_MASK_FOCUS_CHANGE
+          ),
+          "select focus events on window", old_region->window
+      );
+    }
+  }
+  munmap(old, info.st_size);
+  log_msg(
+      LOG_LEVEL_INFO, "Restored %d windows in %.3fms",
+      window_index_size, (get_time_ns() - start_time) / 1e6
+  );
+}
+static void check_restored_window(
+    void *reply, xcb_generic_error_t *error,
+    xcb_window_t window, uint32_t data
+) {
+  if (reply) return;
+  window_entry_t *entry = find_window(window);
+  if (!entry) return;
+  int ws = entry->workspace;
+  remove_region(ws, entry->region);
+  if (window == focused_window) focused_window = 0;
+  publish_ipc_event(IPC_EVENT_WINDOW_UNMANAGED, ws, window);
+}
+static void map_snapshot_windows(const state_header_t *old, size_t size) {
+  /*
+  A snapshot we can't restore from still says which windows were ours.
+  Those on hidden workspaces are unmapped, and adopt_windows() only takes
+  mapped ones, so map them all first or they'd be left invisible. This
+  only goes by the header and the region records, whose layout
+  region_size vouches for, so a different version or number of
+  workspaces doesn't stop it.
+  */
+  if (
+    old->magic != STATE_MAGIC
+    || old->region_size != sizeof(state_region_t)
+    || old->num_workspaces
+      > (size - sizeof(state_header_t)) / sizeof(state_workspace_t)
+  ) return;
+  const state_workspace_t *old_workspaces =
+    (const state_workspace_t *)(old + 1);
+  const state_region_t *old_regions =
+    (const state_region_t *)(old_workspaces + old->num_workspaces);
+  size_t num_regions = (size - sizeof(state_header_t)
+    - old->num_workspaces * sizeof(state_workspace_t))
+    / sizeof(state_region_t);
+  int num_mapped = 0;
+  for (uint32_t ws = 0; ws < old->num_workspaces; ws++) {
+    uint32_t first = old_workspaces[ws].first_region;
+    uint32_t count = old_workspaces[ws].num_regions;
+    if (first > num_regions || count > num_regions - first) continue;
+    for (uint32_t i = first; i < first + count; i++) {
+      if (!old_regions[i].exists || !old_regions[i].window) continue;
+      track_request(
+          backend->map_window(old_regions[i].window),
+          "map window from snapshot", old_regions[i].window
+      );
+      num_mapped++;
+    }
+  }
+  log_msg(
+      LOG_LEVEL_INFO, "Mapped %d windows from the snapshot to adopt",
+      num_mapped
+  );
+}
+static void find_executable(const char *name) {
+  /*
+  Restarting after a rebuild has to run the new binary, and the linker
+  writes that out as a new file, so /proc/self/exe would still be the old
+  one. Remember where we were run from instead, resolved now in case
+  PATH or the working directory changes later.
+  */
+  if (strchr(name, '/')) {
+    if (!realpath(name, executable_path)) executable_path[0] = '\0';
+    return;
+  }
+  const char *path = getenv("PATH");
+  if (!path) path = "/usr/local/bin:/usr/bin:/bin";
+  while (*path) {
+    size_t length = strcspn(path, ":");
+    if (
+      length
+      && snprintf(
+          executable_path, sizeof(executable_path),
+          "%.*s/%s", (int)length, path, name
+      ) < (int)sizeof(executable_path)
+      && !access(executable_path, X_OK)
+    ) return;
+    path += length;
+    if (*path) path++;
+  }
+  executable_path[0] = '\0';
+}
+static void restart(int argc, char *argv[]) {
+  /*
+  Hand the layout over to a fresh copy of ourselves through the state
+  snapshot. Windows aren't touched, the new instance takes them back from
+  the snapshot instead of unmapping and tiling them again.
+  */
+  finish_batch();
+  int fd = -1;
+  if (state_fd >= 0) {
+    publish_state();
+    /* Without close-on-exec, so it survives into the new instance */
+    fd = dup(state_fd);
+  }
+  char **new_argv = calloc(argc + 3, sizeof(char *));
+  char fd_string[16];
+  snprintf(fd_string, sizeof(fd_string), "%d", fd);
+  int new_argc = 0;
+  for (int i = 0; i < argc; i++) {
+    /* A second --record would truncate the trace we've written so far */
+    if (
+      (!strcmp(argv[i], "--restore-fd") || !strcmp(argv[i], "--record"))
+      && i + 1 < argc
+    ) {
+      i++;
+      continue;
+    }
+    new_argv[new_argc++] = argv[i];
+  }
+  if (fd >= 0) {
+    new_argv[new_argc++] = "--restore-fd";
+    new_argv[new_argc++] = fd_string;
+  }
+  log_msg(LOG_LEVEL_INFO, "Restarting...");
+  cleanup();
+
+  /*
+  Blocked signals and the mask itself carry over an exec. Take what's
+  pending now rather than unblocking it, since a pending SIGHUP would
+  kill us.
+  */
+  sigset_t blocked;
+  sigprocmask(SIG_BLOCK, NULL, &blocked);
+  const struct timespec no_wait = { 0, 0 };
+  while (sigtimedwait(&blocked, NULL, &no_wait) > 0);
+  sigprocmask(SIG_SETMASK, &original_sigmask, NULL);
+  if (executable_path[0]) {
+    execv(executable_path, new_argv);
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to run %s (%s), restarting the running binary",
+        executable_path, strerror(errno)
+    );
+    flush_log(true);
+  }
+  execv("/proc/self/exe", new_argv);
+  log_msg(LOG_LEVEL_ERROR, "Failed to restart (%s)", strerror(errno));
+}
+static bool parse_ipc_window(const char *word, xcb_window_t *window) {
+  /* Decimal or 0x-prefixed hex, like xwininfo prints them */
+  char *end;
+  unsigned long value = strtoul(word, &end, 0);
+  if (*end || !value || value > UINT32_MAX) return false;
+  *window = value;
+  return true;
+}
+static bool parse_ipc_workspace(const char *word, int *ws) {
+  char *end;
+  long value = strtol(word, &end, 10);
+  if (*end || value < 0 || value >= NUM_WORKSPACES) return false;
+  *ws = value;
+  return true;
+}
+static void get_setup_info(void) {
+  setup = xcb_get_setup(connection);
+  if (!setup)
+    log_msg(LOG_LEVEL_ERROR, "Failed to get setup information");
+  log_msg(
+      LOG_LEVEL_INFO, "setup.protocol_major_version = %d",
+      setup->protocol_major_version
+  );
+  log_msg(
+      LOG_LEVEL_INFO, "setup.protocol_minor_version = %d",
+      setup->protocol_minor_version
+  );
+  xcb_screen_iterator_t screen_iterator = xcb_setup_roots_iterator(setup);
+  screen = screen_iterator.data;
+  log_msg(
+      LOG_LEVEL_INFO, "screen.width_in_millimeters = %d",
+      screen->width_in_millimeters
+  );
+  log_msg(
+      LOG_LEVEL_INFO, "screen.height_in_millimeters = %d",
+      screen->height_in_millimeters
+  );
+  log_msg(
+      LOG_LEVEL_INFO, "screen.width_in_pixels = %d",
+      screen->width_in_pixels
+  );
+  log_msg(
+      LOG_LEVEL_INFO, "screen.height_in_pixels = %d",
+      screen->height_in_pixels
+  );
+  root = screen->root;
+}
+static uint64_t get_time_ns(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+static void intern_atoms(void) {
+  /*
+  Send out every request before waiting on any of the replies, so this
+  costs one round trip no matter how many atoms there are. The modifier
+  mapping rides along, find_numlock() needs it once the keymap is loaded.
+  */
+  uint64_t start_time = get_time_ns();
+  xcb_intern_atom_cookie_t cookies[NUM_ATOMS];
+  for (int i = 0; i < NUM_ATOMS; i++)
+    cookies[i] = xcb_intern_atom(
+        connection, 0, strlen(ATOM_NAMES[i]), ATOM_NAMES[i]
+    );
+  xcb_get_modifier_mapping_cookie_t modifier_cookie =
+    xcb_get_modifier_mapping(connection);
+  loop_stats.blocking_waits++;
+  for (int i = 0; i < NUM_ATOMS; i++) {
+    xcb_generic_error_t *error = NULL;
+    xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(
+        connection, cookies[i], &error
+    );
+    if (!reply) {
+      if (error)
+        log_msg(
+            LOG_LEVEL_ERROR,
+            "Failed to get atom: %s (%d)", ATOM_NAMES[i], error->error_code
+        );
+      else
+        log_msg(LOG_LEVEL_ERROR, "Failed to get atom: %s", ATOM_NAMES[i]);
+    }
+    atoms[i] = reply->atom;
+    free(reply);
+    if (!atoms[i])
+      log_msg(LOG_LEVEL_ERROR, "Failed to get atom: %s", ATOM_NAMES[i]);
+  }
+  modifier_mapping = xcb_get_modifier_mapping_reply(
+      connection, modifier_cookie, NULL
+  );
+  log_msg(
+      LOG_LEVEL_INFO, "Got %d atoms in %.3fms",
+      NUM_ATOMS, (get_time_ns() - start_time) / 1e6
+  );
+}
+static void adopt_windows(void) {
+  /*
+  Take over windows that were mapped before we started. Their attributes
+  are all requested before any reply is waited on, and they're added to
+  the tree before the first batch ends, so there's one round trip for the
+  tree, one for the attributes and one layout pass however many there are.
+  Anything mapped since we selected events on root is deduplicated by
+  manage_window().
+  */
+  uint64_t start_time = get_time_ns();
+  xcb_generic_error_t *error = NULL;
+  loop_stats.blocking_waits++;
+  xcb_query_tree_reply_t *tree = xcb_query_tree_reply(
+      connection, xcb_query_tree(connection, root), &error
+  );
+  if (!tree) {
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to query existing windows (%d)", error ? error->error_code : 0
+    );
+    free(error);
+    return;
+  }
+  xcb_window_t *tree_children = xcb_query_tree_children(tree);
+  int num_tree_children = xcb_query_tree_children_length(tree);
+  int num_known = window_index_size;
+  for (int i = 0; i < num_tree_children; i++) {
+    /* Restored windows are already being checked */
+    if (find_window(tree_children[i])) continue;
+    await_reply(
+        backend->get_window_attributes(tree_children[i]),
+        manage_window, tree_children[i], root
+    );
+  }
+  free(tree);
+  while (finish_continuation(true));
+  log_msg(
+      LOG_LEVEL_INFO, "Adopted %d of %d existing windows in %.3fms",
+      window_index_size - num_known, num_tree_children,
+      (get_time_ns() - start_time) / 1e6
+  );
+}
+static void set_event_mask(xcb_window_t window, uint32_t event_mask) {
+  /*
+  This is only used on the root window at startup, where failure means
+  another window manager is running, so it's worth the round trip.
+  */
   xcb_generic_error_t *error = NULL;
-  xcb_void_cookie_t cookie = xcb_change_window_attributes(
+  xcb_void_cookie_t cookie = xcb_change_window_attributes_checked(
       connection, window, XCB_CW_EVENT_MASK, &event_mask
   );
+  loop_stats.blocking_waits++;
   error = xcb_request_check(connection, cookie);
   if (error) {
     int error_code = error->error_code;
@@ -546,14 +3302,347 @@ static void set_event_mask(xcb_window_t window, uint32_t event_mask) {
     );
   }
 }
+static void track_request(
+    unsigned int sequence, const char *operation, xcb_window_t window
+) {
+  request_record_t *record = &request_history[sequence % REQUEST_HISTORY];
+  record->sequence = sequence;
+  record->operation = operation;
+  record->window = window;
+}
+static void await_reply(
+    unsigned int sequence,
+    void (*handler)(
+        void *reply, xcb_generic_error_t *error,
+        xcb_window_t window, uint32_t data
+    ),
+    xcb_window_t window, uint32_t data
+) {
+  loop_stats.replies_awaited++;
+  /* Replies arrive in order, so if we're full the oldest is worth waiting on */
+  if (num_continuations == MAX_CONTINUATIONS)
+    finish_continuation(true);
+  continuation_t *continuation = &continuations[
+    (first_continuation + num_continuations++) % MAX_CONTINUATIONS
+  ];
+  continuation->sequence = sequence;
+  continuation->handler = handler;
+  continuation->window = window;
+  continuation->data = data;
+}
+static bool finish_continuation(bool block) {
+  if (!num_continuations) return false;
+  continuation_t continuation = continuations[first_continuation];
+  void *reply = NULL;
+  xcb_generic_error_t *error = NULL;
+  if (block) {
+    loop_stats.blocking_waits++;
+    reply = backend->wait_for_reply(continuation.sequence, &error);
+  }
+  else if (!backend->poll_for_reply(continuation.sequence, &reply, &error))
+    return false;
+  first_continuation = (first_continuation + 1) % MAX_CONTINUATIONS;
+  num_continuations--;
+  continuation.handler(reply, error, continuation.window, continuation.data);
+  free(reply);
+  free(error);
+  return true;
+}
+static bool process_continuations(void) {
+  bool finished = false;
+  while (finish_continuation(false))
+    finished = true;
+  return finished;
+}
+static void dispatch_event(xcb_generic_event_t *event) {
+  dispatch_time = get_time_ns();
+  if (trace_file) trace_event(event);
+  uint8_t type = event->response_type & ~0x80;
+  event_counts[type]++;
+  if (type < (sizeof(EVENT_HANDLERS)/sizeof(EVENT_HANDLERS[0])))
+    if (EVENT_HANDLERS[type]) {
+      EVENT_HANDLERS[type](event);
+      record_latency(&event_latencies[type], get_time_ns() - dispatch_time);
+    }
+}
+static void init_event_loop(void) {
+  /*
+  Everything is driven from one epoll set: the X connection, signals
+  through a signalfd and deferred work through a timerfd. Nothing polls,
+  so the window manager doesn't wake up at all when it's idle.
+  */
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    log_msg(LOG_LEVEL_ERROR, "Failed to create epoll (%s)", strerror(errno));
+  watch_fd(xcb_get_file_descriptor(connection), EPOLLIN, handle_connection);
+
+  sigset_t sigmask;
+  sigemptyset(&sigmask);
+  sigaddset(&sigmask, SIGCHLD);
+  sigaddset(&sigmask, SIGTERM);
+  sigaddset(&sigmask, SIGHUP);
+  sigaddset(&sigmask, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &sigmask, &original_sigmask);
+  signal_fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd < 0)
+    log_msg(LOG_LEVEL_ERROR, "Failed to create signalfd (%s)", strerror(errno));
+  watch_fd(signal_fd, EPOLLIN, handle_signal);
+
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd < 0)
+    log_msg(LOG_LEVEL_ERROR, "Failed to create timerfd (%s)", strerror(errno));
+  watch_fd(timer_fd, EPOLLIN, handle_timer);
+
+  if (launcher_fd >= 0)
+    watch_fd(launcher_fd, EPOLLIN, handle_launcher);
+}
+static void watch_fd(
+    int fd, uint32_t events, void (*handler)(int fd, uint32_t events)
+) {
+  if (fd >= MAX_FDS)
+    log_msg(LOG_LEVEL_ERROR, "File descriptor %d is too high to watch", fd);
+  struct epoll_event event = { .events = events, .data.fd = fd };
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    log_msg(
+        LOG_LEVEL_ERROR,
+        "Failed to watch file descriptor %d (%s)", fd, strerror(errno)
+    );
+  fd_handlers[fd] = handler;
+}
+static void unwatch_fd(int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  fd_handlers[fd] = NULL;
+}
+static void wait_for_events(void) {
+  /* Idle is the cheapest time to write the log out */
+  flush_log(false);
+  struct epoll_event events[16];
+  int num_events = epoll_wait(
+      epoll_fd, events, sizeof(events)/sizeof(events[0]), -1
+  );
+  if (num_events < 0 && errno != EINTR)
+    log_msg(LOG_LEVEL_ERROR, "Failed to wait for events (%s)", strerror(errno));
+  for (int i = 0; i < num_events; i++)
+    /* An earlier handler may have stopped watching it */
+    if (fd_handlers[events[i].data.fd])
+      fd_handlers[events[i].data.fd](events[i].data.fd, events[i].events);
+}
+static void finish_batch(void) {
+  /*
+  Handlers only mark regions dirty and queue requests, so however many
+  events came in, the batch costs one layout pass and one flush.
+  */
+  loop_stats.batches++;
+  for (;;) {
+    update_layout();
+    if (switching) end_workspace_switches();
+    if (trace_file) trace_batch();
+    backend->flush();
+    if (ipc_topics) flush_ipc_clients();
+    if (state_changed && state_fd >= 0) publish_state();
+    /*
+    Flushing can read in events and replies, which epoll won't tell us
+    about, and whatever handles them can start another batch's worth
+    */
+    bool finished = process_continuations();
+    xcb_generic_event_t *event = backend->poll_for_queued_event();
+    if (!event && !finished) break;
+    if (!event) continue;
+    dispatch_event(event);
+    free(event);
+    handle_connection(-1, EPOLLIN);
+  }
+}
+static void defer(uint64_t delay_ns, void (*callback)(void)) {
+  /* Deferring something that's already waiting keeps the earlier deadline */
+  uint64_t deadline = get_time_ns() + delay_ns;
+  for (int i = 0; i < num_deferred; i++) {
+    if (deferred[i].callback != callback) continue;
+    if (deadline < deferred[i].deadline) {
+      deferred[i].deadline = deadline;
+      arm_timer();
+    }
+    return;
+  }
+  if (num_deferred == MAX_DEFERRED)
+    log_msg(LOG_LEVEL_ERROR, "Too much deferred work");
+  deferred[num_deferred].deadline = deadline;
+  deferred[num_deferred].callback = callback;
+  num_deferred++;
+  arm_timer();
+}
+static void arm_timer(void) {
+  /* A zero it_value disarms the timer */
+  struct itimerspec timer = { 0 };
+  uint64_t deadline = UINT64_MAX;
+  for (int i = 0; i < num_deferred; i++)
+    if (deferred[i].deadline < deadline)
+      deadline = deferred[i].deadline;
+  if (num_deferred) {
+    timer.it_value.tv_sec = deadline / 1000000000;
+    timer.it_value.tv_nsec = deadline % 1000000000;
+    /* Already due, but it_value can't be zero */
+    if (!deadline) timer.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0)
+    log_msg(LOG_LEVEL_ERROR, "Failed to arm timer (%s)", strerror(errno));
+}
+static void handle_connection(int fd, uint32_t events) {
+  xcb_generic_event_t *event = backend->poll_for_event();
+  for (;;) {
+    while (event) {
+      dispatch_event(event);
+      free(event);
+      event = backend->poll_for_queued_event();
+    }
+    /* Finishing replies reads from the connection, which can queue events */
+    bool finished = process_continuations();
+    event = backend->poll_for_queued_event();
+    if (!event && !finished) break;
+  }
+  int connection_error = backend->connection_error();
+  if (connection_error)
+    log_msg(
+        LOG_LEVEL_ERROR,
+        "Lost connection to X server (%d)", connection_error
+    );
+}
+static void handle_signal(int fd, uint32_t events) {
+  struct signalfd_siginfo info;
+  while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+    switch (info.ssi_signo) {
+      case SIGCHLD:
+        reap_children();
+        break;
+      case SIGUSR1:
+        dump_stats();
+        break;
+      case SIGHUP:
+        log_msg(LOG_LEVEL_INFO, "Got signal %d, restarting...", info.ssi_signo);
+        restarting = true;
+        running = false;
+        break;
+      case SIGTERM:
+        log_msg(LOG_LEVEL_INFO, "Got signal %d, quitting...", info.ssi_signo);
+        running = false;
+        break;
+    }
+  }
+}
+static void handle_timer(int fd, uint32_t events) {
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+  uint64_t now = get_time_ns();
+  /* Callbacks can defer more work, so take the due ones out first */
+  void (*due[MAX_DEFERRED])(void);
+  int num_due = 0;
+  for (int i = 0; i < num_deferred;) {
+    if (deferred[i].deadline <= now) {
+      due[num_due++] = deferred[i].callback;
+      deferred[i] = deferred[--num_deferred];
+    } else i++;
+  }
+  arm_timer();
+  for (int i = 0; i < num_due; i++)
+    due[i]();
+}
 static void init_xkb(void) {
   xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
   xkb_keymap = xkb_keymap_new_from_names(
       xkb_context, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS
   );
   xkb_state = xkb_state_new(xkb_keymap);
+  index_keysyms();
+  find_numlock();
+}
+static void find_numlock(void) {
+  /* Whichever modifier has a Num_Lock key on it, it isn't always Mod2 */
+  if (!modifier_mapping) return;
+  int per_modifier = modifier_mapping->keycodes_per_modifier;
+  xcb_keycode_t *keycodes =
+    xcb_get_modifier_mapping_keycodes(modifier_mapping);
+  int first = find_keysym(XKB_KEY_Num_Lock);
+  for (int i = 0; first >= 0 && i < 8 * per_modifier; i++) {
+    bool numlock = false;
+    for (
+      int entry = first;
+      entry < keysym_index_size
+      && keysym_index[entry].keysym == XKB_KEY_Num_Lock;
+      entry++
+    )
+      numlock |= keycodes[i] && keycodes[i] == keysym_index[entry].keycode;
+    if (!numlock) continue;
+    numlock_mask = 1 << (i / per_modifier);
+    break;
+  }
+  free(modifier_mapping);
+  modifier_mapping = NULL;
+  log_msg(LOG_LEVEL_INFO, "Numlock is modifier mask 0x%x", numlock_mask);
+}
+static int compare_keysym_entries(const void *a, const void *b) {
+  const keysym_entry_t *entry_a = a, *entry_b = b;
+  if (entry_a->keysym != entry_b->keysym)
+    return entry_a->keysym < entry_b->keysym ? -1 : 1;
+  if (entry_a->keycode != entry_b->keycode)
+    return entry_a->keycode < entry_b->keycode ? -1 : 1;
+  return 0;
+}
+static void index_keysyms(void) {
+  /* Walk the keymap once, so grabbing each keymap is just a lookup */
+  xkb_keycode_t min = xkb_keymap_min_keycode(xkb_keymap);
+  xkb_keycode_t max = xkb_keymap_max_keycode(xkb_keymap);
+  int capacity = 0;
+  for (xkb_keycode_t i = min; i <= max; i++) {
+    xkb_level_index_t num_levels =
+      xkb_keymap_num_levels_for_key(xkb_keymap, i, 0);
+    for (xkb_level_index_t level = 0; level < num_levels; level++) {
+      const xkb_keysym_t *keysyms;
+      int num_keysyms =
+        xkb_keymap_key_get_syms_by_level(xkb_keymap, i, 0, level, &keysyms);
+      for (int j = 0; j < num_keysyms; j++) {
+        if (keysym_index_size == capacity) {
+          capacity = capacity ? capacity * 2 : 256;
+          keysym_index =
+            realloc(keysym_index, capacity * sizeof(keysym_entry_t));
+          if (!keysym_index)
+            log_msg(LOG_LEVEL_ERROR, "Failed to allocate keysym index");
+        }
+        keysym_index[keysym_index_size].keysym = keysyms[j];
+        keysym_index[keysym_index_size].keycode = i;
+        keysym_index_size++;
+      }
+    }
+  }
+  qsort(
+      keysym_index, keysym_index_size, sizeof(keysym_entry_t),
+      compare_keysym_entries
+  );
+  /* A key can have the same keysym on more than one level */
+  int size = 0;
+  for (int i = 0; i < keysym_index_size; i++)
+    if (
+      !size
+      || compare_keysym_entries(&keysym_index[size-1], &keysym_index[i])
+    )
+      keysym_index[size++] = keysym_index[i];
+  keysym_index_size = size;
+  log_msg(LOG_LEVEL_INFO, "Indexed %d keysyms", keysym_index_size);
+}
+static int find_keysym(xkb_keysym_t keysym) {
+  /* Returns the first entry for keysym, or -1 */
+  int low = 0, high = keysym_index_size;
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (keysym_index[mid].keysym < keysym) low = mid + 1;
+    else high = mid;
+  }
+  if (low < keysym_index_size && keysym_index[low].keysym == keysym)
+    return low;
+  return -1;
 }
-static void grab_keymap(uint16_t modifiers, xkb_keysym_t keysym) {
+static void grab_keymap(int keymap) {
+  uint16_t modifiers = KEYMAPS[keymap].modifiers;
+  xkb_keysym_t keysym = KEYMAPS[keymap].keysym;
   char keyname[64];
   if (xkb_keysym_get_name(keysym, keyname, sizeof(keyname)) < 0)
     memcpy(keyname, "???\0", 4);
@@ -570,64 +3659,95 @@ static void grab_keymap(uint16_t modifiers, xkb_keysym_t keysym) {
       modifiers & XCB_MOD_MASK_5 ? "AltGr+" : "",
       keyname
   );
-    
-  xkb_keycode_t xkb_keycode;
-  xkb_keycode_t min = xkb_keymap_min_keycode(xkb_keymap);
-  xkb_keycode_t max = xkb_keymap_max_keycode(xkb_keymap);
-  bool found = false;
-  for (xkb_keycode_t i = min; i <= max; i++) {
-    int num_keysyms;
-    const xkb_keysym_t *keysyms;
-    num_keysyms =
-      xkb_keymap_key_get_syms_by_level(xkb_keymap, i, 0, 0, &keysyms);
-    for (int j = 0; j < num_keysyms; j++) {
-      if (keysyms[j] == keysym) {
-        found = true;
-        xkb_keycode = i;
-      }
-    }
-  }
-  if (!found) log_msg(LOG_LEVEL_ERROR, "Couldn't find keysym %d", keysym);
 
-  xcb_keycode_t keycode = (xcb_keycode_t)xkb_keycode;
-  xcb_generic_error_t *error = NULL;
-  xcb_void_cookie_t cookie = xcb_grab_key(
-      connection,
-      0,
-      root,
-      modifiers, keycode,
-      XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC
-  );
-  error = xcb_request_check(connection, cookie);
-  if (error) {
-    int error_code = error->error_code;
-    free(error);
-    log_msg(LOG_LEVEL_ERROR, "Failed to grab keys: (%d)", error_code
-    );
+  int first = find_keysym(keysym);
+  if (first < 0) log_msg(LOG_LEVEL_ERROR, "Couldn't find keysym %d", keysym);
+  /* Grab every key that produces the keysym */
+  for (
+    int entry = first;
+    entry < keysym_index_size && keysym_index[entry].keysym == keysym;
+    entry++
+  ) {
+    xcb_keycode_t keycode = (xcb_keycode_t)keysym_index[entry].keycode;
+    if (keymap_table[keycode][KEYMAP_MODIFIERS(modifiers)])
+      log_msg(LOG_LEVEL_WARNING, "Combination %s is bound twice", keyname);
+    keymap_table[keycode][KEYMAP_MODIFIERS(modifiers)] = keymap + 1;
+    /* Grab it with every combination of capslock and numlock too */
+    const uint16_t ignored[] = {
+      0, XCB_MOD_MASK_LOCK, numlock_mask, XCB_MOD_MASK_LOCK | numlock_mask
+    };
+    for (int i = 0; i < (int)(sizeof(ignored)/sizeof(ignored[0])); i++) {
+      track_request(
+          backend->grab_key(root, modifiers | ignored[i], keycode),
+          "grab key on window", root
+      );
+    }
   }
 }
 static void change_window_rect(
     xcb_window_t window, uint16_t x, uint16_t y, uint16_t width, uint16_t height
 ) {
-  uint32_t value_list[4] = { x, y, width, height };
-  xcb_void_cookie_t cookie = xcb_configure_window(
-      connection, window,
-      XCB_CONFIG_WINDOW_X
-      | XCB_CONFIG_WINDOW_Y
-      | XCB_CONFIG_WINDOW_WIDTH
-      | XCB_CONFIG_WINDOW_HEIGHT,
-      value_list
+  /* Only send what changed, every ConfigureWindow makes the client redraw */
+  window_entry_t *entry = find_window(window);
+  bool known = entry && entry->configured;
+  uint32_t value_list[4];
+  uint16_t value_mask = 0;
+  uint8_t num_values = 0;
+  if (!known || entry->x != x) {
+    value_mask |= XCB_CONFIG_WINDOW_X;
+    value_list[num_values++] = x;
+  }
+  if (!known || entry->y != y) {
+    value_mask |= XCB_CONFIG_WINDOW_Y;
+    value_list[num_values++] = y;
+  }
+  if (!known || entry->width != width) {
+    value_mask |= XCB_CONFIG_WINDOW_WIDTH;
+    value_list[num_values++] = width;
+  }
+  if (!known || entry->height != height) {
+    value_mask |= XCB_CONFIG_WINDOW_HEIGHT;
+    value_list[num_values++] = height;
+  }
+  if (!value_mask) return;
+  layout_changed = true;
+  if (entry) {
+    entry->configured = true;
+    entry->x = x;
+    entry->y = y;
+    entry->width = width;
+    entry->height = height;
+  }
+  track_request(
+      backend->configure_window(window, value_mask, value_list),
+      "configure window", window
   );
-  xcb_generic_error_t *error = xcb_request_check(connection, cookie);
-  if (error) {
-    int error_code = error->error_code;
-    free(error);
-    log_msg(LOG_LEVEL_ERROR, "Failed to configure window (%d)", error_code);
+}
+static void mark_dirty(int ws, int region) {
+  state_changed = true;
+  /* Stop early, since a dirty region's ancestors are always dirty too */
+  while (region >= 0 && !regions[ws][region].dirty) {
+    regions[ws][region].dirty = true;
+    region = regions[ws][region].parent;
   }
 }
 static void refresh_layout(
     int region, uint16_t x, uint16_t y, uint16_t width, uint16_t height
 ) {
+  /* Nothing under a clean region changes unless its own rect does */
+  if (
+    !regions[workspace][region].dirty
+    && regions[workspace][region].x == x
+    && regions[workspace][region].y == y
+    && regions[workspace][region].width == width
+    && regions[workspace][region].height == height
+  ) return;
+  regions[workspace][region].x = x;
+  regions[workspace][region].y = y;
+  regions[workspace][region].width = width;
+  regions[workspace][region].height = height;
+  regions[workspace][region].dirty = false;
+  loop_stats.regions_laid_out++;
   if (regions[workspace][region].handle) {
     change_window_rect(
         regions[workspace][region].handle,
@@ -652,119 +3772,213 @@ static void refresh_layout(
       regions[workspace][region].split == DIR_VERTICAL ? (height-h) : h
   );
 }
-static int get_empty_region(void) {
-  int region = -1;
-  for (int i = 0; i < MAX_REGIONS; i++) {
-    if (!(regions[workspace][i].exists)) {
-      region = i;
-      break;
+static uint32_t hash_window(xcb_window_t window) {
+  /* Window IDs share their high bits, so mix the low ones upwards */
+  uint32_t hash = window * 2654435761u;
+  return hash ^ (hash >> 16);
+}
+static window_entry_t *find_window(xcb_window_t window) {
+  if (!window || !window_index_size) return NULL;
+  uint32_t mask = window_index_capacity - 1;
+  for (uint32_t i = hash_window(window) & mask;; i = (i + 1) & mask) {
+    if (window_index[i].window == window) return &window_index[i];
+    if (!window_index[i].window) return NULL;
+  }
+}
+static void grow_window_index(void) {
+  window_entry_t *old_index = window_index;
+  int old_capacity = window_index_capacity;
+  window_index_capacity = old_capacity ? old_capacity * 2 : 64;
+  window_index = calloc(window_index_capacity, sizeof(window_entry_t));
+  if (!window_index)
+    log_msg(LOG_LEVEL_ERROR, "Failed to allocate window index");
+  uint32_t mask = window_index_capacity - 1;
+  for (int i = 0; i < old_capacity; i++) {
+    if (!old_index[i].window) continue;
+    uint32_t j = hash_window(old_index[i].window) & mask;
+    while (window_index[j].window) j = (j + 1) & mask;
+    window_index[j] = old_index[i];
+  }
+  free(old_index);
+}
+static void index_window(xcb_window_t window, int ws, int region) {
+  window_entry_t *entry = find_window(window);
+  if (!entry) {
+    /* Keep the load factor at most a half, so probes stay short */
+    if ((window_index_size + 1) * 2 > window_index_capacity)
+      grow_window_index();
+    uint32_t mask = window_index_capacity - 1;
+    uint32_t i = hash_window(window) & mask;
+    while (window_index[i].window) i = (i + 1) & mask;
+    entry = &window_index[i];
+    entry->window = window;
+    entry->configured = false;
+    window_index_size++;
+  }
+  entry->workspace = ws;
+  entry->region = region;
+}
+static void unindex_window(xcb_window_t window) {
+  window_entry_t *entry = find_window(window);
+  if (!entry) return;
+  /* Shift later entries back into the hole, so no tombstones are needed */
+  uint32_t mask = window_index_capacity - 1;
+  uint32_t hole = entry - window_index;
+  for (
+    uint32_t i = (hole + 1) & mask;
+    window_index[i].window;
+    i = (i + 1) & mask
+  ) {
+    uint32_t home = hash_window(window_index[i].window) & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      window_index[hole] = window_index[i];
+      hole = i;
+    }
+  }
+  window_index[hole].window = 0;
+  window_index_size--;
+}
+static int get_empty_region(int ws) {
+  if (free_regions[ws] < 0) {
+    /* Indices are kept when growing, so links between regions stay valid */
+    int capacity = region_capacity[ws] ? region_capacity[ws] * 2 : 8;
+    region_t *grown = realloc(regions[ws], capacity * sizeof(region_t));
+    if (!grown)
+      log_msg(LOG_LEVEL_ERROR, "Failed to allocate regions");
+    regions[ws] = grown;
+    for (int i = capacity - 1; i >= region_capacity[ws]; i--) {
+      regions[ws][i].exists = false;
+      regions[ws][i].parent = free_regions[ws];
+      free_regions[ws] = i;
     }
+    region_capacity[ws] = capacity;
   }
-  if (region < 0)
-    log_msg(LOG_LEVEL_ERROR, "Too many regions");
+  int region = free_regions[ws];
+  free_regions[ws] = regions[ws][region].parent;
   return region;
 }
-static void add_region(xcb_window_t parent_window, xcb_window_t window) {
-  if (root_regions[workspace] < 0) {
-    regions[workspace][0].handle = window;
-    regions[workspace][0].parent = -1;
-    regions[workspace][0].child0 = -1;
-    regions[workspace][0].child1 = -1;
-    regions[workspace][0].split = DIR_HORIZONTAL;
-    regions[workspace][0].factor = 0.0f;
-    regions[workspace][0].exists = true;
-    root_regions[workspace] = 0;
-    refresh_layout(
-        root_regions[workspace],
-        0, 0, screen->width_in_pixels, screen->height_in_pixels
-    );
+static void free_region(int ws, int region) {
+  regions[ws][region].exists = false;
+  regions[ws][region].handle = 0;
+  regions[ws][region].parent = free_regions[ws];
+  free_regions[ws] = region;
+}
+static void update_layout(void) {
+  /* Cheap when nothing changed, a clean root stops straight away */
+  if (root_regions[workspace] < 0) return;
+  if (regions[workspace][root_regions[workspace]].dirty)
+    loop_stats.relayouts++;
+  refresh_layout(
+      root_regions[workspace],
+      0, 0, screen->width_in_pixels, screen->height_in_pixels
+  );
+}
+static void add_region(
+    int ws, xcb_window_t parent_window, xcb_window_t window
+) {
+  if (root_regions[ws] < 0) {
+    int region = get_empty_region(ws);
+    regions[ws][region].handle = window;
+    regions[ws][region].parent = -1;
+    regions[ws][region].child0 = -1;
+    regions[ws][region].child1 = -1;
+    regions[ws][region].split = DIR_HORIZONTAL;
+    regions[ws][region].factor = 0.0f;
+    regions[ws][region].exists = true;
+    regions[ws][region].dirty = false;
+    root_regions[ws] = region;
+    index_window(window, ws, region);
+    mark_dirty(ws, region);
     return;
   }
   int parent = -1;
-  for (int i = 0; i < MAX_REGIONS; i++)
-    if (regions[workspace][i].handle == parent_window)
-      parent = i;
-  if (parent < 0) parent = root_regions[workspace];
-  int new_region = get_empty_region();
-  regions[workspace][new_region].exists = true;
-  int new_window_region = get_empty_region();
-  regions[workspace][new_window_region].exists = true;
-  int grandparent = regions[workspace][parent].parent;
-  if (grandparent < 0) root_regions[workspace] = new_region;
-  regions[workspace][parent].parent = new_region;
-  regions[workspace][new_region].handle = 0;
-  regions[workspace][new_region].parent = grandparent;
-  regions[workspace][new_region].child0 = new_window_region;
-  regions[workspace][new_region].child1 = parent;
-  regions[workspace][new_region].split = DIR_HORIZONTAL;
-  regions[workspace][new_region].factor = 0.5f;
+  window_entry_t *parent_entry = find_window(parent_window);
+  if (parent_entry && parent_entry->workspace == ws)
+    parent = parent_entry->region;
+  if (parent < 0) parent = root_regions[ws];
+  int new_region = get_empty_region(ws);
+  regions[ws][new_region].exists = true;
+  int new_window_region = get_empty_region(ws);
+  regions[ws][new_window_region].exists = true;
+  int grandparent = regions[ws][parent].parent;
+  if (grandparent < 0) root_regions[ws] = new_region;
+  regions[ws][parent].parent = new_region;
+  regions[ws][new_region].handle = 0;
+  regions[ws][new_region].parent = grandparent;
+  regions[ws][new_region].child0 = new_window_region;
+  regions[ws][new_region].child1 = parent;
+  regions[ws][new_region].split = DIR_HORIZONTAL;
+  regions[ws][new_region].factor = 0.5f;
+  regions[ws][new_region].dirty = false;
   if (grandparent >= 0) {
-    if (regions[workspace][grandparent].child0 == parent)
-      regions[workspace][grandparent].child0 = new_region;
-    else if (regions[workspace][grandparent].child1 == parent)
-      regions[workspace][grandparent].child1 = new_region;
+    if (regions[ws][grandparent].child0 == parent)
+      regions[ws][grandparent].child0 = new_region;
+    else if (regions[ws][grandparent].child1 == parent)
+      regions[ws][grandparent].child1 = new_region;
     else
       log_msg(LOG_LEVEL_ERROR, "Corrupted region tree");
   }
-  regions[workspace][new_window_region].handle = window;
-  regions[workspace][new_window_region].parent = new_region;
-  regions[workspace][new_window_region].child0 = -1;
-  regions[workspace][new_window_region].child1 = -1;
-  regions[workspace][new_window_region].split = DIR_HORIZONTAL;
-  regions[workspace][new_window_region].factor = 0.0f;
-  refresh_layout(
-      root_regions[workspace],
-      0, 0, screen->width_in_pixels, screen->height_in_pixels
-  );
+  regions[ws][new_window_region].handle = window;
+  regions[ws][new_window_region].parent = new_region;
+  regions[ws][new_window_region].child0 = -1;
+  regions[ws][new_window_region].child1 = -1;
+  regions[ws][new_window_region].split = DIR_HORIZONTAL;
+  regions[ws][new_window_region].factor = 0.0f;
+  regions[ws][new_window_region].dirty = false;
+  index_window(window, ws, new_window_region);
+  mark_dirty(ws, new_window_region);
 }
-static void remove_region(int region) {
-  regions[workspace][region].exists = false;
-  int parent = regions[workspace][region].parent;
+static void remove_region(int ws, int region) {
+  unindex_window(regions[ws][region].handle);
+  int parent = regions[ws][region].parent;
+  free_region(ws, region);
   if (parent < 0) {
-    if (region != root_regions[workspace])
+    if (region != root_regions[ws])
       log_msg(LOG_LEVEL_ERROR, "Corrupted region tree");
-    root_regions[workspace] = -1;
-    regions[workspace][root_regions[workspace]].exists = false;
+    /* Empty workspaces don't need to hold on to any memory */
+    root_regions[ws] = -1;
+    free(regions[ws]);
+    regions[ws] = NULL;
+    region_capacity[ws] = 0;
+    state_changed = true;
+    free_regions[ws] = -1;
     return;
   }
-  regions[workspace][parent].exists = false;
   int sibling = -1;
-  if (regions[workspace][parent].child0 == region)
-    sibling = regions[workspace][parent].child1;
-  else if (regions[workspace][parent].child1 == region)
-    sibling = regions[workspace][parent].child0;
+  if (regions[ws][parent].child0 == region)
+    sibling = regions[ws][parent].child1;
+  else if (regions[ws][parent].child1 == region)
+    sibling = regions[ws][parent].child0;
   else
     log_msg(LOG_LEVEL_ERROR, "Corrupted region tree");
-  int grandparent = regions[workspace][parent].parent;
-  if (grandparent < 0) {
-    root_regions[workspace] = sibling;
-    regions[workspace][sibling].parent = -1;
-    refresh_layout(
-        root_regions[workspace],
-        0, 0, screen->width_in_pixels, screen->height_in_pixels
-    );
-    return;
-  }
-  regions[workspace][sibling].parent = grandparent;
-  if (regions[workspace][grandparent].child0 == parent)
-    regions[workspace][grandparent].child0 = sibling;
-  else if (regions[workspace][grandparent].child1 == parent)
-    regions[workspace][grandparent].child1 = sibling;
+  int grandparent = regions[ws][parent].parent;
+  free_region(ws, parent);
+  regions[ws][sibling].parent = grandparent;
+  if (grandparent < 0)
+    root_regions[ws] = sibling;
+  else if (regions[ws][grandparent].child0 == parent)
+    regions[ws][grandparent].child0 = sibling;
+  else if (regions[ws][grandparent].child1 == parent)
+    regions[ws][grandparent].child1 = sibling;
   else
     log_msg(LOG_LEVEL_ERROR, "Corrupted region tree");
-  refresh_layout(
-      root_regions[workspace],
-      0, 0, screen->width_in_pixels, screen->height_in_pixels
-  );
+  /* The sibling takes over the parent's space */
+  mark_dirty(ws, sibling);
 }
-static bool window_isfloat(xcb_window_t window) {
-  bool floating = false;
-  xcb_generic_error_t *error = NULL;
-  xcb_get_window_attributes_cookie_t attributes_cookie =
-    xcb_get_window_attributes(connection, window);
-  xcb_get_window_attributes_reply_t *attributes =
-    xcb_get_window_attributes_reply(connection, attributes_cookie, &error);
+static bool window_isfloat(
+    const xcb_get_window_attributes_reply_t *attributes
+) {
+  if (attributes->override_redirect) return true;
+  if (attributes->map_state != XCB_MAP_STATE_VIEWABLE) return true;
+  return false;
+}
+static void manage_window(
+    void *reply, xcb_generic_error_t *error,
+    xcb_window_t window, uint32_t parent_window
+) {
+  xcb_get_window_attributes_reply_t *attributes = reply;
   if (!attributes) {
+    /* Most likely the window was destroyed before we got to it */
     if (error)
       log_msg(
           LOG_LEVEL_WARNING,
@@ -775,42 +3989,211 @@ static bool window_isfloat(xcb_window_t window) {
           LOG_LEVEL_WARNING,
           "Failed to get window attributes (no generic error)"
       );
-  } else {
-    if (attributes->override_redirect) floating = true;
-    if (attributes->map_state != XCB_MAP_STATE_VIEWABLE) floating = true;
-    free(attributes);
+    return;
+  }
+  if (window_isfloat(attributes)) return;
+  /* It may have been mapped again while we were waiting */
+  if (find_window(window)) return;
+  add_region(workspace, parent_window, window);
+  /* So focus changes can be passed on to subscribers */
+  track_request(
+      backend->change_event_mask(window, XCB_EVENT_MASK_FOCUS_CHANGE),
+      "select focus events on window", window
+  );
+  publish_ipc_event(IPC_EVENT_WINDOW_MANAGED, workspace, window);
+}
+static void end_workspace_switches(void) {
+  track_request(backend->ungrab_server(), "ungrab server for window", root);
+  /* Its reply comes back once the server has processed the whole burst */
+  await_reply(
+      backend->get_input_focus(), finish_workspace_switch, 0, workspace
+  );
+  switching = false;
+}
+static void finish_workspace_switch(
+    void *reply, xcb_generic_error_t *error,
+    xcb_window_t window, uint32_t new_workspace
+) {
+  double switch_time = (get_time_ns() - switch_start_time) / 1e6;
+  log_msg(
+      switch_time > FRAME_TIME ? LOG_LEVEL_WARNING : LOG_LEVEL_INFO,
+      "Switched to workspace %d in %.3fms", (int)new_workspace, switch_time
+  );
+}
+static bool check_requests(
+    const char *operation, request_type_t type, int expected
+) {
+  if (fake_request_counts[type] == expected) return true;
+  log_msg(
+      LOG_LEVEL_WARNING,
+      "%s sent %d requests of type %d, expected %d",
+      operation, fake_request_counts[type], (int)type, expected
+  );
+  return false;
+}
+static int run_microbench(void) {
+  /*
+  Runs the layout code against the fake server, so only our own work is
+  timed and every request it sends can be counted exactly.
+  */
+  init_fake_server();
+  for (int i = 0; i < NUM_WORKSPACES; i++) {
+    root_regions[i] = -1;
+    free_regions[i] = -1;
+  }
+  const int n = MICROBENCH_WINDOWS;
+  const xcb_window_t first_window = 0x200000;
+  bool passed = true;
+  uint64_t add_time = 0, layout_time = 0, relayout_time = 0, remove_time = 0;
+  log_msg(
+      LOG_LEVEL_INFO, "Running %d rounds of %d windows...",
+      MICROBENCH_ROUNDS, n
+  );
+  log_level_t original_level = log_level;
+  if (log_level < LOG_LEVEL_WARNING) log_level = LOG_LEVEL_WARNING;
+  for (int round = 0; round < MICROBENCH_ROUNDS; round++) {
+    memset(fake_request_counts, 0, sizeof(fake_request_counts));
+    /* Split each window's parent, so the tree stays balanced */
+    uint64_t start_time = get_time_ns();
+    for (int i = 0; i < n; i++)
+      add_region(workspace, i ? first_window + i / 2 : 0, first_window + i);
+    add_time += get_time_ns() - start_time;
+
+    start_time = get_time_ns();
+    update_layout();
+    layout_time += get_time_ns() - start_time;
+    /* Every window is new, so each is configured exactly once */
+    passed &= check_requests("Layout", REQUEST_CONFIGURE_WINDOW, n);
+
+    /* Nothing moves, so nothing should be sent */
+    start_time = get_time_ns();
+    for (int i = 0; i < n; i++) {
+      window_entry_t *entry = find_window(first_window + i);
+      mark_dirty(workspace, regions[workspace][entry->region].parent);
+      update_layout();
+    }
+    relayout_time += get_time_ns() - start_time;
+    passed &= check_requests("Relayout", REQUEST_CONFIGURE_WINDOW, n);
+
+    start_time = get_time_ns();
+    for (int i = n - 1; i >= 0; i--)
+      remove_region(workspace, find_window(first_window + i)->region);
+    remove_time += get_time_ns() - start_time;
+    if (root_regions[workspace] >= 0 || window_index_size) {
+      log_msg(LOG_LEVEL_WARNING, "Windows were left behind");
+      passed = false;
+    }
+  }
+
+  /* The same again through the event handlers, as one batch */
+  memset(fake_request_counts, 0, sizeof(fake_request_counts));
+  for (int i = 0; i < n; i++) {
+    xcb_map_notify_event_t event = {
+      .response_type = XCB_MAP_NOTIFY,
+      .event = root,
+      .window = first_window + i
+    };
+    fake_inject_event(&event, sizeof(event));
   }
-  return floating;
+  handle_connection(-1, EPOLLIN);
+  finish_batch();
+  passed &= check_requests("Managing", REQUEST_GET_WINDOW_ATTRIBUTES, n);
+  passed &= check_requests("Managing", REQUEST_CONFIGURE_WINDOW, n);
+  passed &= check_requests("Managing", REQUEST_CHANGE_EVENT_MASK, n);
+  /*
+  A switch is one burst: grab, every map and unmap, ungrab, one round
+  trip. Switches in the same batch share it.
+  */
+  memset(fake_request_counts, 0, sizeof(fake_request_counts));
+  xcb_key_press_event_t key_press = { .response_type = XCB_KEY_PRESS };
+  uint64_t start_time = get_time_ns();
+  handle_keymap_workspace(&key_press, (keymap_data_t){ .i32 = 2 });
+  handle_keymap_workspace(&key_press, (keymap_data_t){ .i32 = 1 });
+  finish_batch();
+  uint64_t switch_time = get_time_ns() - start_time;
+  handle_connection(-1, EPOLLIN);
+  passed &= check_requests("Switching", REQUEST_GRAB_SERVER, 1);
+  passed &= check_requests("Switching", REQUEST_UNMAP_WINDOW, n);
+  passed &= check_requests("Switching", REQUEST_MAP_WINDOW, n);
+  passed &= check_requests("Switching", REQUEST_UNGRAB_SERVER, 1);
+  passed &= check_requests("Switching", REQUEST_GET_INPUT_FOCUS, 1);
+  passed &= check_requests("Switching", REQUEST_CONFIGURE_WINDOW, 0);
+  log_level = original_level;
+
+  double ops = (double)MICROBENCH_ROUNDS * n;
+  log_msg(
+      LOG_LEVEL_INFO, "add_region: %.1fns per window (%.2fM per second)",
+      add_time / ops, ops / add_time * 1e3
+  );
+  log_msg(
+      LOG_LEVEL_INFO, "refresh_layout: %.1fns per window, from scratch",
+      layout_time / ops
+  );
+  log_msg(
+      LOG_LEVEL_INFO,
+      "refresh_layout: %.1fns per change (%.2fM per second)",
+      relayout_time / ops, ops / relayout_time * 1e3
+  );
+  log_msg(
+      LOG_LEVEL_INFO, "remove_region: %.1fns per window (%.2fM per second)",
+      remove_time / ops, ops / remove_time * 1e3
+  );
+  log_msg(
+      LOG_LEVEL_INFO, "Switching workspace: %.3fms with %d windows",
+      switch_time / 2e6, n
+  );
+  log_msg(
+      passed ? LOG_LEVEL_INFO : LOG_LEVEL_WARNING,
+      passed ? "All request counts matched" : "Request counts didn't match"
+  );
+  return passed ? 0 : 1;
 }
 
 /* Event handler definitions */
+static void handle_error(xcb_generic_error_t *error) {
+  /*
+  Errors for unchecked requests arrive here, usually because a client
+  destroyed its window while requests for it were still in flight.
+  */
+  request_record_t *record =
+    &request_history[error->full_sequence % REQUEST_HISTORY];
+  if (record->operation && record->sequence == error->full_sequence)
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "Failed to %s %d (%d)",
+        record->operation, (int)record->window, error->error_code
+    );
+  else
+    log_msg(
+        LOG_LEVEL_WARNING,
+        "X error %d for request %d.%d (sequence %u)",
+        error->error_code, error->major_code, error->minor_code,
+        (unsigned int)error->full_sequence
+    );
+}
 static void handle_create_notify(xcb_create_notify_event_t *event) { }
 static void handle_destroy_notify(xcb_destroy_notify_event_t *event) {
   log_msg(LOG_LEVEL_INFO, "Processing destroy notify...");
-  int region = -1;
-  for (int i = 0; i < MAX_REGIONS; i++)
-    if (
-      regions[workspace][i].exists
-      && (regions[workspace][i].handle == event->window)
-    )
-      region = i;
-  if (region < 0) {
+  window_entry_t *entry = find_window(event->window);
+  if (!entry) {
     log_msg(
         LOG_LEVEL_WARNING,
         "Recieved destroy notify for window not in region tree"
     );
     return;
   }
-  remove_region(region);
+  int ws = entry->workspace;
+  remove_region(ws, entry->region);
+  if (event->window == focused_window) focused_window = 0;
+  publish_ipc_event(IPC_EVENT_WINDOW_UNMANAGED, ws, event->window);
 }
 static void handle_map_notify(xcb_map_notify_event_t *event) {
   log_msg(LOG_LEVEL_INFO, "Processing map notify...");
-  for (int i = 0; i < NUM_WORKSPACES; i++)
-    for (int j = 0; j < MAX_REGIONS; j++)
-      if (regions[i][j].exists && regions[i][j].handle == event->window)
-        return;
-  if (!window_isfloat(event->window))
-    add_region(event->event, event->window);
+  if (find_window(event->window)) return;
+  await_reply(
+      backend->get_window_attributes(event->window),
+      manage_window, event->window, event->event
+  );
 }
 static void handle_unmap_notify(xcb_unmap_notify_event_t *event) { }
 static void handle_reparent_notify(xcb_reparent_notify_event_t *event) { }
@@ -818,56 +4201,87 @@ static void handle_configure_notify(xcb_configure_notify_event_t *event) { }
 static void handle_gravity_notify(xcb_gravity_notify_event_t *event) { }
 static void handle_map_request(xcb_map_request_event_t *event) {
   log_msg(LOG_LEVEL_INFO, "Processing map request...");
-  xcb_void_cookie_t cookie = xcb_map_window(connection, event->window);
-  xcb_generic_error_t *error = xcb_request_check(connection, cookie);
-  if (error) {
-    log_msg(LOG_LEVEL_ERROR, "Failed to map window (%d)", error->error_code);
-    free(error);
-  }
-  xcb_flush(connection);
+  track_request(
+      backend->map_window(event->window), "map window", event->window
+  );
 }
 static void handle_configure_request(xcb_configure_request_event_t *event) {
   log_msg(LOG_LEVEL_INFO, "Processing configure request...");
 
+  /*
+  Tiled windows stay where the layout put them. Only stacking and borders
+  are passed on, and as ICCCM 4.1.5 asks, the client is told where it
+  really is with a synthetic ConfigureNotify rather than a second
+  ConfigureWindow.
+  */
+  window_entry_t *entry = find_window(event->window);
+  uint16_t value_mask = event->value_mask;
+  if (entry)
+    value_mask &= ~(
+      XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y
+      | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT
+    );
   uint32_t value_list[7];
   uint8_t num_values = 0;
-  if (event->value_mask & XCB_CONFIG_WINDOW_X)
+  if (value_mask & XCB_CONFIG_WINDOW_X)
     value_list[num_values++] = event->x;
-  if (event->value_mask & XCB_CONFIG_WINDOW_Y)
+  if (value_mask & XCB_CONFIG_WINDOW_Y)
     value_list[num_values++] = event->y;
-  if (event->value_mask & XCB_CONFIG_WINDOW_WIDTH)
+  if (value_mask & XCB_CONFIG_WINDOW_WIDTH)
     value_list[num_values++] = event->width;
-  if (event->value_mask & XCB_CONFIG_WINDOW_HEIGHT)
+  if (value_mask & XCB_CONFIG_WINDOW_HEIGHT)
     value_list[num_values++] = event->height;
-  if (event->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+  if (value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
     value_list[num_values++] = event->border_width;
-  if (event->value_mask & XCB_CONFIG_WINDOW_SIBLING)
+  if (value_mask & XCB_CONFIG_WINDOW_SIBLING)
     value_list[num_values++] = event->sibling;
-  if (event->value_mask & XCB_CONFIG_WINDOW_STACK_MODE)
+  if (value_mask & XCB_CONFIG_WINDOW_STACK_MODE)
     value_list[num_values++] = event->stack_mode;
 
-  xcb_void_cookie_t cookie = xcb_configure_window(
-      connection, event->window,
-      event->value_mask, value_list
-  );
-  xcb_generic_error_t *error = xcb_request_check(connection, cookie);
-  if (error) {
-    log_msg(
-        LOG_LEVEL_ERROR,
-        "Failed to configure window (%d)",
-        error->error_code
+  /* One that hasn't been laid out yet will be told by its first configure */
+  if (entry && entry->configured) {
+    const xcb_configure_notify_event_t notify = {
+      .response_type = XCB_CONFIGURE_NOTIFY,
+      .event = event->window,
+      .window = event->window,
+      .above_sibling = XCB_NONE,
+      .x = entry->x,
+      .y = entry->y,
+      .width = entry->width,
+      .height = entry->height,
+      .border_width = 0,
+      .override_redirect = 0
+    };
+    track_request(
+        backend->send_event(event->window, &notify),
+        "send ConfigureNotify to window", event->window
     );
-    free(error);
   }
-  xcb_flush(connection);
+  if (!value_mask) return;
+  track_request(
+      backend->configure_window(event->window, value_mask, value_list),
+      "configure window", event->window
+  );
 }
 static void handle_circulate_request(xcb_circulate_request_event_t *event) { }
 static void handle_key_press(xcb_key_press_event_t *event) {
-  xkb_keysym_t keysym = xkb_state_key_get_one_sym(xkb_state, event->detail);
-  for (int i = 0; i < NUM_KEYMAPS; i++)
-    if ((event->state == KEYMAPS[i].modifiers) && keysym == KEYMAPS[i].keysym)
-      KEYMAPS[i].handler(event, KEYMAPS[i].data);
+  int keymap = keymap_table[event->detail][KEYMAP_MODIFIERS(event->state)] - 1;
+  if (keymap < 0) return;
+  uint64_t start_time = get_time_ns();
+  KEYMAPS[keymap].handler(event, KEYMAPS[keymap].data);
+  record_latency(&keymap_latencies[keymap], get_time_ns() - start_time);
 }
 static void handle_key_release(xcb_key_release_event_t *event) { }
-static void handle_focus_in(xcb_focus_in_event_t *event) { }
+static void handle_focus_in(xcb_focus_in_event_t *event) {
+  /* Grabbing keys moves focus about too, that isn't worth passing on */
+  if (
+    event->mode == XCB_NOTIFY_MODE_GRAB
+    || event->mode == XCB_NOTIFY_MODE_UNGRAB
+  ) return;
+  window_entry_t *entry = find_window(event->event);
+  if (!entry || event->event == focused_window) return;
+  focused_window = event->event;
+  state_changed = true;
+  publish_ipc_event(IPC_EVENT_FOCUS, entry->workspace, focused_window);
+}
 static void handle_focus_out(xcb_focus_out_event_t *event) { }